@@ -0,0 +1,646 @@
+// getrusage, mkdir and fork under -std=c99
+#define _POSIX_C_SOURCE 200809L
+
+#include <libvx.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/time.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#define bench_mkdir(_p) _mkdir(_p)
+#else
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define bench_mkdir(_p) mkdir(_p, 0755)
+#endif
+
+#define LASSERT(_v, ...) if(!(_v)){ fprintf(stderr, __VA_ARGS__); fprintf(stderr, "\n"); exit(1); };
+
+// Generates a fixed set of clips (once, they are deterministic) and decodes each of them in every
+// output format and mode. Each mode runs in a process of its own (where there is fork) so that its
+// peak memory use isn't hidden by the modes before it. Results are written as JSON to stdout,
+// progress goes to stderr.
+
+#define BENCH_FPS 30
+#define BENCH_NUM_FRAMES 150
+#define BENCH_OPEN_RUNS 5
+
+typedef enum {
+	BENCH_INTACT,
+	BENCH_DAMAGED,
+	BENCH_TRUNCATED
+} bench_corruption;
+
+typedef struct {
+	const char* name;
+	const char* encoder;
+	const char* container;
+	const char* ext;
+	int width, height;
+	int gop;
+	bool audio;
+	bench_corruption corruption;
+} bench_clip;
+
+static const bench_clip clips[] = {
+	{"mpeg4_320x240_gop12_audio",    "mpeg4",      "mp4",      "mp4", 320,  240,  12,  true,  BENCH_INTACT},
+	{"mpeg4_1280x720_gop250",        "mpeg4",      "mp4",      "mp4", 1280, 720,  250, false, BENCH_INTACT},
+	{"mpeg2_640x480_gop1",           "mpeg2video", "matroska", "mkv", 640,  480,  1,   false, BENCH_INTACT},
+	{"mjpeg_640x480_audio",          "mjpeg",      "avi",      "avi", 640,  480,  1,   true,  BENCH_INTACT},
+	{"h264_1280x720_gop60_audio",    "libx264",    "mp4",      "mp4", 1280, 720,  60,  true,  BENCH_INTACT},
+	{"h264_1920x1080_gop250",        "libx264",    "matroska", "mkv", 1920, 1080, 250, false, BENCH_INTACT},
+	{"mpeg4_640x480_gop12_damaged",  "mpeg4",      "matroska", "mkv", 640,  480,  12,  true,  BENCH_DAMAGED},
+	{"mpeg4_640x480_gop12_truncated","mpeg4",      "mp4",      "mp4", 640,  480,  12,  true,  BENCH_TRUNCATED},
+};
+
+typedef struct {
+	const char* name;
+	vx_pix_fmt pix_fmt;
+	int flags;
+	int async_frames;
+	vx_io_mode io_mode;
+	bool ref;
+	double sample_fps;
+} bench_mode;
+
+static const bench_mode modes[] = {
+	{"rgb24",          VX_PIX_FMT_RGB24,   0,                    0, VX_IO_DEFAULT, false, 0},
+	{"gray8",          VX_PIX_FMT_GRAY8,   0,                    0, VX_IO_DEFAULT, false, 0},
+	{"rgb32",          VX_PIX_FMT_RGB32,   0,                    0, VX_IO_DEFAULT, false, 0},
+	{"yuv420p",        VX_PIX_FMT_YUV420P, 0,                    0, VX_IO_DEFAULT, false, 0},
+	{"nv12",           VX_PIX_FMT_NV12,    0,                    0, VX_IO_DEFAULT, false, 0},
+	{"gray16",         VX_PIX_FMT_GRAY16,  0,                    0, VX_IO_DEFAULT, false, 0},
+	{"gbrp",           VX_PIX_FMT_GBRP,    0,                    0, VX_IO_DEFAULT, false, 0},
+	{"ref",            VX_PIX_FMT_UNKNOWN, 0,                    0, VX_IO_DEFAULT, true,  0},
+	{"single_thread",  VX_PIX_FMT_RGB24,   VX_OF_SINGLE_THREAD,  0, VX_IO_DEFAULT, false, 0},
+	{"async",          VX_PIX_FMT_RGB24,   0,                    8, VX_IO_DEFAULT, false, 0},
+	{"keyframes_only", VX_PIX_FMT_RGB24,   VX_OF_KEYFRAMES_ONLY, 0, VX_IO_DEFAULT, false, 0},
+	{"sample_1fps",    VX_PIX_FMT_RGB24,   0,                    0, VX_IO_DEFAULT, false, 1},
+	{"pread",          VX_PIX_FMT_RGB24,   0,                    0, VX_IO_PREAD,   false, 0},
+	{"mmap",           VX_PIX_FMT_RGB24,   0,                    0, VX_IO_MMAP,    false, 0},
+	{"fast_open",      VX_PIX_FMT_RGB24,   VX_OF_FAST_OPEN,      0, VX_IO_DEFAULT, false, 0},
+};
+
+#define NUM_CLIPS ((int)(sizeof(clips) / sizeof(clips[0])))
+#define NUM_MODES ((int)(sizeof(modes) / sizeof(modes[0])))
+
+typedef struct {
+	AVCodecContext* ctx;
+	AVStream* stream;
+	AVFrame* frame;
+	int64_t next_pts;
+} bench_stream;
+
+static double bench_now(void)
+{
+	return av_gettime_relative() / 1000000.0;
+}
+
+static long bench_peak_rss_kb(void)
+{
+#ifdef _WIN32
+	return -1;
+#else
+	struct rusage usage;
+
+	if(getrusage(RUSAGE_SELF, &usage) != 0)
+		return -1;
+
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+#endif
+}
+
+static void bench_json_str(const char* str)
+{
+	putchar('"');
+
+	for(; *str; str++){
+		if(*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if((unsigned char)*str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+
+	putchar('"');
+}
+
+// sends frame (NULL flushes) and writes whatever comes out of the encoder
+static int bench_encode(AVFormatContext* fmt_ctx, bench_stream* s, AVFrame* frame, AVPacket* packet)
+{
+	int ret = avcodec_send_frame(s->ctx, frame);
+
+	if(ret < 0)
+		return ret;
+
+	while((ret = avcodec_receive_packet(s->ctx, packet)) >= 0){
+		av_packet_rescale_ts(packet, s->ctx->time_base, s->stream->time_base);
+		packet->stream_index = s->stream->index;
+
+		if((ret = av_interleaved_write_frame(fmt_ctx, packet)) < 0)
+			return ret;
+	}
+
+	return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+static bool bench_open_stream(AVFormatContext* fmt_ctx, bench_stream* s, const AVCodec* codec)
+{
+	// bit exact output so that the clips are the same on every run
+	s->ctx->flags |= AV_CODEC_FLAG_BITEXACT;
+	s->ctx->thread_count = 1;
+
+	if(fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+		s->ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	if(avcodec_open2(s->ctx, codec, NULL) < 0)
+		return false;
+
+	s->stream = avformat_new_stream(fmt_ctx, NULL);
+	s->frame = av_frame_alloc();
+
+	if(!s->stream || !s->frame || avcodec_parameters_from_context(s->stream->codecpar, s->ctx) < 0)
+		return false;
+
+	s->stream->time_base = s->ctx->time_base;
+
+	return true;
+}
+
+// moving gradients, every frame is different and compresses like a smooth natural image
+static void bench_fill_video(AVFrame* frame, int i)
+{
+	for(int y = 0; y < frame->height; y++){
+		uint8_t* row = frame->data[0] + y * frame->linesize[0];
+
+		for(int x = 0; x < frame->width; x++)
+			row[x] = x + y + i * 3;
+	}
+
+	for(int y = 0; y < frame->height / 2; y++){
+		uint8_t* u = frame->data[1] + y * frame->linesize[1];
+		uint8_t* v = frame->data[2] + y * frame->linesize[2];
+
+		for(int x = 0; x < frame->width / 2; x++){
+			u[x] = 128 + y + i * 2;
+			v[x] = 64 + x + i * 5;
+		}
+	}
+}
+
+// a 440 Hz tone in the left channel and 660 Hz in the right, as integer math
+static void bench_fill_audio(AVFrame* frame, int64_t first_sample)
+{
+	int16_t* samples = (int16_t*)frame->data[0];
+
+	for(int i = 0; i < frame->nb_samples; i++){
+		int64_t t = first_sample + i;
+
+		samples[i * 2 + 0] = (int16_t)(((t * 440 * 2 * 8000 / frame->sample_rate) % 16000) - 8000);
+		samples[i * 2 + 1] = (int16_t)(((t * 660 * 2 * 8000 / frame->sample_rate) % 16000) - 8000);
+	}
+}
+
+static bool bench_generate(const bench_clip* clip, const char* path)
+{
+	bool ok = false;
+	AVFormatContext* fmt_ctx = NULL;
+	AVPacket* packet = av_packet_alloc();
+	bench_stream video = {0}, audio = {0};
+
+	const AVCodec* video_codec = avcodec_find_encoder_by_name(clip->encoder);
+	const AVCodec* audio_codec = clip->audio ? avcodec_find_encoder(AV_CODEC_ID_MP2) : NULL;
+
+	if(!packet || !video_codec || (clip->audio && !audio_codec))
+		goto cleanup;
+
+	if(avformat_alloc_output_context2(&fmt_ctx, NULL, clip->container, path) < 0)
+		goto cleanup;
+
+	fmt_ctx->flags |= AVFMT_FLAG_BITEXACT;
+
+	video.ctx = avcodec_alloc_context3(video_codec);
+
+	if(!video.ctx)
+		goto cleanup;
+
+	video.ctx->width = clip->width;
+	video.ctx->height = clip->height;
+	video.ctx->time_base = (AVRational){1, BENCH_FPS};
+	video.ctx->framerate = (AVRational){BENCH_FPS, 1};
+	video.ctx->gop_size = clip->gop;
+	video.ctx->max_b_frames = clip->gop > 2 ? 2 : 0;
+	video.ctx->bit_rate = (int64_t)clip->width * clip->height * 4;
+	video.ctx->pix_fmt = video_codec->pix_fmts ? video_codec->pix_fmts[0] : AV_PIX_FMT_YUV420P;
+
+	// bench_fill_video writes 4:2:0
+	if(video.ctx->pix_fmt != AV_PIX_FMT_YUV420P && video.ctx->pix_fmt != AV_PIX_FMT_YUVJ420P)
+		goto cleanup;
+
+	if(!bench_open_stream(fmt_ctx, &video, video_codec))
+		goto cleanup;
+
+	video.frame->format = video.ctx->pix_fmt;
+	video.frame->width = clip->width;
+	video.frame->height = clip->height;
+
+	if(av_frame_get_buffer(video.frame, 0) < 0)
+		goto cleanup;
+
+	if(audio_codec){
+		audio.ctx = avcodec_alloc_context3(audio_codec);
+
+		if(!audio.ctx)
+			goto cleanup;
+
+		audio.ctx->sample_fmt = AV_SAMPLE_FMT_S16;
+		audio.ctx->sample_rate = 44100;
+		audio.ctx->channels = 2;
+		audio.ctx->channel_layout = AV_CH_LAYOUT_STEREO;
+		audio.ctx->bit_rate = 128000;
+		audio.ctx->time_base = (AVRational){1, 44100};
+
+		if(!bench_open_stream(fmt_ctx, &audio, audio_codec))
+			goto cleanup;
+
+		audio.frame->format = AV_SAMPLE_FMT_S16;
+		audio.frame->sample_rate = 44100;
+		audio.frame->channels = 2;
+		audio.frame->channel_layout = AV_CH_LAYOUT_STEREO;
+		audio.frame->nb_samples = audio.ctx->frame_size;
+
+		if(av_frame_get_buffer(audio.frame, 0) < 0)
+			goto cleanup;
+	}
+
+	if(avio_open(&fmt_ctx->pb, path, AVIO_FLAG_WRITE) < 0)
+		goto cleanup;
+
+	if(avformat_write_header(fmt_ctx, NULL) < 0)
+		goto cleanup;
+
+	// interleave by timestamp, audio stops with the last video frame
+	while(video.next_pts < BENCH_NUM_FRAMES){
+		bool write_audio = audio.ctx &&
+			av_compare_ts(audio.next_pts, audio.ctx->time_base, video.next_pts, video.ctx->time_base) < 0;
+
+		bench_stream* s = write_audio ? &audio : &video;
+
+		if(av_frame_make_writable(s->frame) < 0)
+			goto cleanup;
+
+		if(write_audio)
+			bench_fill_audio(s->frame, s->next_pts);
+		else
+			bench_fill_video(s->frame, (int)s->next_pts);
+
+		s->frame->pts = s->next_pts;
+		s->next_pts += write_audio ? s->frame->nb_samples : 1;
+
+		if(bench_encode(fmt_ctx, s, s->frame, packet) < 0)
+			goto cleanup;
+	}
+
+	if(bench_encode(fmt_ctx, &video, NULL, packet) < 0 || (audio.ctx && bench_encode(fmt_ctx, &audio, NULL, packet) < 0))
+		goto cleanup;
+
+	ok = av_write_trailer(fmt_ctx) >= 0;
+
+cleanup:
+	if(fmt_ctx && fmt_ctx->pb)
+		avio_closep(&fmt_ctx->pb);
+
+	if(fmt_ctx)
+		avformat_free_context(fmt_ctx);
+
+	avcodec_free_context(&video.ctx);
+	avcodec_free_context(&audio.ctx);
+	av_frame_free(&video.frame);
+	av_frame_free(&audio.frame);
+	av_packet_free(&packet);
+
+	if(!ok)
+		remove(path);
+
+	return ok;
+}
+
+// damages the middle of the file (or cuts it off) the same way every time
+static bool bench_corrupt(const char* path, bench_corruption corruption)
+{
+	FILE* f = fopen(path, "rb");
+
+	if(!f)
+		return false;
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	unsigned char* data = malloc(size > 0 ? size : 1);
+	bool ok = data && fread(data, 1, size, f) == (size_t)size;
+	fclose(f);
+
+	if(!ok || size < 16){
+		free(data);
+		return false;
+	}
+
+	if(corruption == BENCH_TRUNCATED){
+		size = size * 6 / 10;
+	}
+	else{
+		uint32_t state = 0x12345678;
+
+		for(int i = 0; i < 32; i++){
+			// xorshift32
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+
+			long pos = size / 4 + (long)(state % (uint32_t)(size / 2));
+
+			for(int j = 0; j < 64 && pos + j < size; j++)
+				data[pos + j] ^= (unsigned char)(state >> (j % 24));
+		}
+	}
+
+	f = fopen(path, "wb");
+	ok = f && fwrite(data, 1, size, f) == (size_t)size;
+
+	if(f)
+		fclose(f);
+
+	free(data);
+	return ok;
+}
+
+static bool bench_file_exists(const char* path)
+{
+	FILE* f = fopen(path, "rb");
+
+	if(f)
+		fclose(f);
+
+	return f != NULL;
+}
+
+static void bench_options(const bench_mode* mode, vx_open_options* options)
+{
+	vx_open_options_init(options);
+	options->flags = mode->flags;
+	options->async_frames = mode->async_frames;
+	options->io_mode = mode->io_mode;
+}
+
+static double bench_open_latency(const char* path, const bench_mode* mode)
+{
+	double total = 0;
+	vx_open_options options;
+	bench_options(mode, &options);
+
+	for(int i = 0; i < BENCH_OPEN_RUNS; i++){
+		vx_video* video;
+		double start = bench_now();
+
+		if(vx_open_ex(&video, path, &options) != VX_ERR_SUCCESS)
+			return -1;
+
+		total += bench_now() - start;
+		vx_close(video);
+	}
+
+	return total / BENCH_OPEN_RUNS;
+}
+
+typedef struct {
+	vx_error error;
+	int frames;
+	double seconds;
+	double open_seconds;
+	long peak_rss_kb;
+	vx_stats stats;
+} bench_result;
+
+static bench_result bench_run(const char* path, const bench_mode* mode)
+{
+	bench_result result;
+	memset(&result, 0, sizeof(result));
+	vx_video* video = NULL;
+	vx_frame* frame = NULL;
+
+	vx_open_options options;
+	bench_options(mode, &options);
+
+	if((result.error = vx_open_ex(&video, path, &options)) != VX_ERR_SUCCESS)
+		return result;
+
+	if(mode->sample_fps > 0)
+		vx_set_sample_fps(video, mode->sample_fps);
+
+	if(!mode->ref){
+		frame = vx_frame_create(vx_get_width(video), vx_get_height(video), mode->pix_fmt);
+
+		if(!frame){
+			result.error = VX_ERR_ALLOCATE;
+			goto cleanup;
+		}
+	}
+
+	// throughput covers decoding only, opening is timed by bench_open_latency and closing is not timed
+	double start = bench_now();
+	vx_error e;
+
+	do{
+		if(mode->ref){
+			vx_frame* ref = NULL;
+			e = vx_get_frame_ref(video, &ref);
+
+			if(ref)
+				vx_frame_destroy(ref);
+		}
+		else{
+			e = vx_get_frame(video, frame);
+		}
+
+		if(e == VX_ERR_SUCCESS)
+			result.frames++;
+
+	} while(e <= VX_ERR_SUCCESS);
+
+	result.seconds = bench_now() - start;
+
+	// running into the end of the file is the expected way out
+	result.error = e == VX_ERR_EOF ? VX_ERR_SUCCESS : e;
+
+cleanup:
+	if(frame)
+		vx_frame_destroy(frame);
+
+	vx_get_stats(video, &result.stats);
+	vx_close(video);
+
+	return result;
+}
+
+static bench_result bench_run_measured(const char* path, const bench_mode* mode)
+{
+	double open_seconds = bench_open_latency(path, mode);
+
+	bench_result result = bench_run(path, mode);
+	result.open_seconds = open_seconds;
+	result.peak_rss_kb = bench_peak_rss_kb();
+
+	return result;
+}
+
+// bench_run_measured in a child process, the peak memory is then that of the mode alone (plus
+// what the benchmark had mapped when it forked)
+static bench_result bench_run_isolated(const char* path, const bench_mode* mode)
+{
+#ifdef _WIN32
+	bench_result result = bench_run_measured(path, mode);
+	result.peak_rss_kb = -1;
+	return result;
+#else
+	bench_result result;
+	memset(&result, 0, sizeof(result));
+	result.error = VX_ERR_UNKNOWN;
+	result.open_seconds = -1;
+	result.peak_rss_kb = -1;
+
+	int fds[2];
+
+	// the child must not write out what is still buffered here a second time
+	fflush(stdout);
+	fflush(stderr);
+
+	if(pipe(fds) != 0)
+		return result;
+
+	pid_t pid = fork();
+
+	if(pid == 0){
+		close(fds[0]);
+
+		bench_result r = bench_run_measured(path, mode);
+		bool sent = write(fds[1], &r, sizeof(r)) == (ssize_t)sizeof(r);
+
+		_exit(sent ? 0 : 1);
+	}
+
+	close(fds[1]);
+
+	if(pid > 0){
+		bench_result r;
+
+		if(read(fds[0], &r, sizeof(r)) == (ssize_t)sizeof(r))
+			result = r;
+
+		waitpid(pid, NULL, 0);
+	}
+
+	close(fds[0]);
+	return result;
+#endif
+}
+
+int main(int argc, char** argv)
+{
+	const char* dir = argc >= 2 ? argv[1] : "vx_bench_media";
+
+	LASSERT(argc <= 2, "usage: %s ([media directory])", argv[0]);
+
+	av_log_set_level(AV_LOG_QUIET);
+	bench_mkdir(dir);
+
+	printf("{\n\t\"avcodec_version\": %u,\n\t\"avformat_version\": %u,\n\t\"clips\": [", avcodec_version(), avformat_version());
+
+	for(int c = 0; c < NUM_CLIPS; c++){
+		const bench_clip* clip = &clips[c];
+		char path[1024];
+
+		snprintf(path, sizeof(path), "%s/%s.%s", dir, clip->name, clip->ext);
+
+		if(!bench_file_exists(path)){
+			fprintf(stderr, "generating %s\n", path);
+
+			if(bench_generate(clip, path) && clip->corruption != BENCH_INTACT)
+				bench_corrupt(path, clip->corruption);
+		}
+
+		printf("%s\n\t\t{\n\t\t\t\"name\": ", c ? "," : "");
+		bench_json_str(clip->name);
+		printf(",\n\t\t\t\"encoder\": ");
+		bench_json_str(clip->encoder);
+		printf(",\n\t\t\t\"width\": %d,\n\t\t\t\"height\": %d,\n\t\t\t\"gop\": %d,\n\t\t\t\"audio\": %s,\n\t\t\t\"frames\": %d,\n",
+			clip->width, clip->height, clip->gop, clip->audio ? "true" : "false", BENCH_NUM_FRAMES);
+
+		// the encoder isn't part of every ffmpeg build
+		if(!bench_file_exists(path)){
+			fprintf(stderr, "skipping %s, could not generate it\n", clip->name);
+			printf("\t\t\t\"skipped\": true\n\t\t}");
+			continue;
+		}
+
+		printf("\t\t\t\"modes\": [");
+
+		double ref_ns = 0, rgb24_ns = 0;
+
+		for(int m = 0; m < NUM_MODES; m++){
+			const bench_mode* mode = &modes[m];
+
+			fprintf(stderr, "%s: %s\n", clip->name, mode->name);
+
+			bench_result r = bench_run_isolated(path, mode);
+			double ns_per_frame = r.frames > 0 ? r.seconds * 1e9 / r.frames : 0;
+
+			if(mode->ref)
+				ref_ns = ns_per_frame;
+
+			if(m == 0)
+				rgb24_ns = ns_per_frame;
+
+			printf("%s\n\t\t\t\t{\"mode\": ", m ? "," : "");
+			bench_json_str(mode->name);
+			printf(", \"error\": ");
+			bench_json_str(vx_get_error_str(r.error));
+			printf(", \"frames\": %d, \"seconds\": %.6f, \"fps\": %.2f, \"ns_per_frame\": %.0f",
+				r.frames, r.seconds, r.seconds > 0 ? r.frames / r.seconds : 0, ns_per_frame);
+			printf(", \"open_ms\": %.3f, \"peak_rss_kb\": %ld", r.open_seconds >= 0 ? r.open_seconds * 1000.0 : -1.0, r.peak_rss_kb);
+
+			// time per stage as counted by libvx, in async mode the stages overlap
+			const vx_stats* st = &r.stats;
+			int n = r.frames > 0 ? r.frames : 1;
+
+			printf(", \"stage_ns_per_frame\": {\"open\": %.0f, \"read\": %.0f, \"decode\": %.0f, \"hw_transfer\": %.0f, \"scale\": %.0f, \"audio\": %.0f, \"output_copy\": %.0f}",
+				st->open_us * 1e3 / n, st->read_us * 1e3 / n, st->decode_us * 1e3 / n,
+				st->hw_transfer_us * 1e3 / n, st->scale_us * 1e3 / n, st->audio_us * 1e3 / n, st->output_copy_us * 1e3 / n);
+
+			printf(", \"packets_read\": %lld, \"decode_errors\": %lld, \"recovery_seeks\": %lld, \"io_bytes_read\": %lld}",
+				st->packets_read, st->decode_errors, st->recovery_seeks, st->io_bytes_read);
+		}
+
+		// decode alone is the ref mode, conversion is what rgb24 costs on top of it
+		printf("\n\t\t\t],\n\t\t\t\"stages_ns_per_frame\": {\"decode\": %.0f, \"convert\": %.0f}\n\t\t}",
+			ref_ns, rgb24_ns > ref_ns ? rgb24_ns - ref_ns : 0);
+	}
+
+	printf("\n\t]\n}\n");
+
+	return 0;
+}
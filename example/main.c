@@ -19,17 +19,12 @@ int main(int argc, char** argv)
 		const char* path = argv[i];
 
 		printf("=== %s ===\n", path);
-		ret = vx_open(&video, path, 0);
+		ret = vx_open(&video, path, VX_OF_HW_ACCEL_1440);
 		LCONTINUE(ret == VX_ERR_SUCCESS, "error: '%s' reported for '%s'", vx_get_error_str(ret), path);	
 
 		ret = vx_count_frames(video, &frame_count);
 		printf("frame count: %d\n", frame_count);
 
-		vx_close(video);
-
-		ret = vx_open(&video, path, VX_OF_HW_ACCEL_1440);
-		LCONTINUE(ret == VX_ERR_SUCCESS, "error: '%s' reported for '%s'", vx_get_error_str(ret), path);	
-
 		int w = vx_get_width(video), h = vx_get_height(video);
 
 		vx_frame* frame = vx_frame_create(w, h, VX_PIX_FMT_GRAY8);
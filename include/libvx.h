@@ -7,13 +7,30 @@ extern "C" {
 
 typedef struct vx_video vx_video;
 typedef struct vx_frame vx_frame;
+typedef struct vx_frame_batch vx_frame_batch;
 
 typedef enum {
+	// a decoder format without a libvx equivalent, only for frames from vx_get_frame_ref
+	VX_PIX_FMT_UNKNOWN = -1,
+
 	VX_PIX_FMT_RGB24 = 0,
 	VX_PIX_FMT_GRAY8 = 1,
 	VX_PIX_FMT_RGB32 = 2,
+
+	// planar and semi-planar formats, see vx_frame_get_plane
+	VX_PIX_FMT_YUV420P = 3,
+	VX_PIX_FMT_NV12 = 4,
+	VX_PIX_FMT_GRAY16 = 5, // native endian
+	VX_PIX_FMT_GBRP = 6,   // planar RGB, planes in G, B, R order
 } vx_pix_fmt;
 
+typedef enum {
+	VX_SCALE_FAST_BILINEAR = 0,
+	VX_SCALE_BILINEAR = 1,
+	VX_SCALE_AREA = 2,
+	VX_SCALE_BICUBIC = 3
+} vx_scale_algorithm;
+
 typedef enum {
 	VX_SAMPLE_FMT_S16 = 0,
 	VX_SAMPLE_FMT_FLT = 1
@@ -37,6 +54,11 @@ typedef enum {
 	VX_ERR_DECODE_AUDIO    = 13,
 	VX_ERR_NO_AUDIO        = 14,
 	VX_ERR_RESAMPLE_AUDIO  = 15,
+	VX_ERR_SEEK            = 16,
+	VX_ERR_INDEX           = 17,
+	VX_ERR_RECOVERY_BUDGET = 18,
+	VX_ERR_TIMEOUT         = 19,
+	VX_ERR_CANCELLED       = 20,
 } vx_error;
 
 typedef enum {
@@ -54,15 +76,238 @@ typedef enum
 	VX_OF_HW_ACCEL_1440 = 8,
 	VX_OF_HW_ACCEL_2160 = 16,
 	VX_OF_HW_ACCEL_HEVC = 32,
-	VX_OF_HW_ACCEL_H264 = 64
+	VX_OF_HW_ACCEL_H264 = 64,
+
+	// decode and scale on the calling thread only, for running one instance per core
+	VX_OF_SINGLE_THREAD = 128,
+
+	// only decode keyframes, see vx_set_keyframes_only
+	VX_OF_KEYFRAMES_ONLY = 256,
+
+	// Never open the video decoder and skip video packets in the demuxer. Audio is read with
+	// vx_read_audio, the video functions return VX_ERR_VIDEO_STREAM and timestamps are in the
+	// audio stream's time base. Fails with VX_ERR_NO_AUDIO when there is no audio.
+	VX_OF_AUDIO_ONLY = 512,
+
+	// Skip the stream analysis when the container header already has the codec and size of the
+	// streams libvx uses, otherwise only the used streams are analyzed. Without the analysis the
+	// frame rate is whatever the header says, vx_get_frame_rate can fail for formats that don't store one.
+	VX_OF_FAST_OPEN = 1024
 } vx_open_flags;
 
+typedef enum {
+	VX_THREAD_AUTO = 0,
+	VX_THREAD_FRAME = 1,
+	VX_THREAD_SLICE = 2
+} vx_thread_type;
+
+typedef enum {
+	// ffmpeg's file protocol
+	VX_IO_DEFAULT = 0,
+
+	// local files only, pread or a read-only mapping of the whole file with sequential access hints
+	// to the kernel. Ignored on Windows. The demuxer still reads through its own buffer, so the
+	// mapping is copied into it like any other input; VX_IO_MMAP saves the read syscalls, not the copy.
+	VX_IO_PREAD = 1,
+	VX_IO_MMAP = 2
+} vx_io_mode;
+
+typedef struct {
+	// vx_open_flags, logically OR'ed
+	int flags;
+
+	// number of decoder threads, 0 picks one per cpu core
+	int thread_count;
+	vx_thread_type thread_type;
+
+	// index file to load on open if it exists and matches the video, see vx_load_index
+	const char* index_filename;
+
+	// Decode on background threads (demux, decode and conversion) up to this many frames ahead of
+	// vx_get_frame. 0 decodes synchronously inside vx_get_frame. Audio callbacks are still called
+	// from vx_get_frame on the calling thread. vx_get_frame still copies each converted frame into
+	// the caller's frame, whose buffer stays put (see output_copy_us in vx_stats), vx_get_frame_ref
+	// avoids the copy.
+	int async_frames;
+
+	// how vx_open and vx_open_ex read the file
+	vx_io_mode io_mode;
+
+	// read buffer for vx_open_mem, vx_open_io and VX_IO_PREAD/MMAP in bytes,
+	// 0 for the default (64 KiB, 1 MiB for VX_IO_PREAD/MMAP)
+	int io_buffer_size;
+
+	// Upper limits for format probing and stream analysis, in bytes and microseconds.
+	// 0 keeps ffmpeg's defaults (5 MB and 5 seconds).
+	long long probe_size;
+	long long analyze_duration;
+
+	// How much of a damaged file may be skipped, and for how long decoding may be stuck in damaged
+	// data, before giving up with VX_ERR_RECOVERY_BUDGET. 0 for no limit, vx_open_options_init
+	// sets 64 MiB and 10 seconds. The budget is for the whole file, it starts over with
+	// vx_count_frames and vx_build_index, which read the file again from the start.
+	long long recovery_max_bytes;
+	int recovery_max_ms;
+
+	// vx_open fails with VX_ERR_TIMEOUT when opening takes longer, 0 for no limit
+	int open_timeout_ms;
+} vx_open_options;
+
+typedef struct {
+	long long pts;
+	long long dts;
+	long long pos;
+	int size;
+
+	// VX_FF_KEYFRAME
+	int flags;
+} vx_index_entry;
+
+typedef enum
+{
+	// start at the keyframe at or before the target timestamp,
+	// or the first keyframe after the target byte position
+	VX_SEEK_KEYFRAME = 0,
+
+	// decode forward from the keyframe and start at the first frame at or after the target timestamp,
+	// or start at the first frame after the target byte position even if it is not a keyframe
+	VX_SEEK_EXACT = 1
+} vx_seek_flags;
+
+typedef enum
+{
+	// exact, one entry per video packet in the index (see vx_build_index)
+	VX_COUNT_INDEX = 0,
+
+	// frame count stored in the container, only trusted where it's exact (mp4/mov)
+	VX_COUNT_CONTAINER = 1,
+
+	// counted video packets, exact unless the file is damaged
+	VX_COUNT_DEMUX = 2
+} vx_count_method;
+
+typedef struct {
+	// AVFrames allocated and recycled, in the steady state only frame_reuses grows.
+	// Frames handed out by vx_get_frame_ref leave the pool for good.
+	long long frame_allocs;
+	long long frame_reuses;
+
+	// input reads and seeks. io_reads is the number of read calls on the underlying input (syscalls
+	// for VX_IO_PREAD) and is not tracked for VX_IO_DEFAULT.
+	long long io_bytes_read;
+	long long io_reads;
+	long long io_seeks;
+
+	// cumulative time in microseconds. open_us covers all of vx_open including probe_us (stream info).
+	long long open_us;
+	long long probe_us;
+	long long read_us;
+	long long decode_us;
+	long long hw_transfer_us;
+	long long scale_us;
+	long long audio_us;
+	// copying frames converted by the async pipeline into the caller's frame, on the calling thread
+	long long output_copy_us;
+
+	long long packets_read;
+	// packets dropped without decoding (unused streams, keyframe only mode)
+	long long packets_discarded;
+	long long frames_decoded;
+	long long hw_transfers;
+	// conversions to the output format, including plain copies
+	long long scale_calls;
+	// audio frames resampled and passed to the audio callback, audio_us includes the callback
+	long long audio_frames;
+
+	// failed packet reads and decoder errors, and the byte skips done to recover from them
+	long long read_errors;
+	long long decode_errors;
+	long long recovery_seeks;
+
+	// bytes skipped and time spent in damaged data, and the skips that landed on a sync point
+	// (container marker, start code or index entry) instead of a blind offset
+	long long recovery_bytes;
+	long long recovery_us;
+	long long sync_points;
+
+	long long frames_deferred;
+
+	// audio for vx_read_audio that was overwritten before it was read
+	long long audio_samples_dropped;
+
+	// most frames waiting in the reorder queue at once
+	int queue_high_water;
+} vx_stats;
+
+// What the container says about a file, see vx_probe. Unknown values are 0, strings are static.
+typedef struct {
+	const char* format_name;
+	double duration;
+	long long bit_rate;
+
+	int has_video;
+	const char* video_codec;
+	int width;
+	int height;
+	float frame_rate;
+	float pixel_aspect_ratio;
+	long long num_frames;
+
+	int has_audio;
+	const char* audio_codec;
+	int audio_sample_rate;
+	int audio_channels;
+} vx_media_info;
+
 typedef void (*vx_audio_callback)(const void* samples, int num_samples, double ts, void* user_data);
 typedef void (*vx_on_count_frames_callback)(int stream, void* user_data);
 
+// Custom input for vx_open_io. read returns the number of bytes read, 0 at the end of the input
+// and a negative value on error. seek takes SEEK_SET, SEEK_CUR or SEEK_END and returns the new
+// position or a negative value on error. size returns the total size or a negative value if unknown.
+typedef int (*vx_read_callback)(void* user_data, unsigned char* buf, int size);
+typedef long long (*vx_seek_callback)(void* user_data, long long offset, int whence);
+typedef long long (*vx_size_callback)(void* user_data);
+
+// Decodes on 1 thread unless flags say otherwise, vx_open_ex with thread_count 0 uses every core.
 vx_error vx_open(vx_video** video, const char* filename, int flags);
+
+// Sets all options to their defaults, call before changing individual options.
+void vx_open_options_init(vx_open_options* options);
+
+// options can be NULL for the defaults.
+vx_error vx_open_ex(vx_video** video, const char* filename, const vx_open_options* options);
+
+// Opens a video from memory. The buffer is not copied and must stay valid until vx_close.
+vx_error vx_open_mem(vx_video** video, const void* buffer, long long size, const vx_open_options* options);
+
+// Opens a video through callbacks. seek_cb and size_cb can be NULL for input that can't seek,
+// in which case seeking, counting and indexing fail or fall back to what the demuxer can do.
+vx_error vx_open_io(vx_video** video, vx_read_callback read_cb, vx_seek_callback seek_cb, vx_size_callback size_cb,
+	void* user_data, const vx_open_options* options);
 void vx_close(vx_video* video);
 
+// Makes a blocked call on video return VX_ERR_CANCELLED as soon as possible, safe to call from any
+// thread. Every later call fails the same way, only vx_close is left to do.
+void vx_cancel(vx_video* video);
+
+// Limits how long each vx_get_frame (and the other frame getters), vx_read_audio, vx_seek,
+// vx_seek_byte, vx_count_frames and vx_build_index call may block, they return VX_ERR_TIMEOUT when it
+// runs out. 0 for no limit.
+// The frame getters and vx_read_audio check the deadline between packets, so a single stalled read
+// is not cut short (vx_cancel is), and they can simply be called again after a timeout. The others
+// also interrupt reads, seek before reading after one of them timed out.
+vx_error vx_set_timeout(vx_video* video, int timeout_ms);
+
+// Reads the container header without opening libvx's decoders or any hardware device. Only when
+// the header lacks the codec or size of a stream does ffmpeg's stream analysis run (as with
+// VX_OF_FAST_OPEN), which decodes a few packets internally. The frame rate is then whatever the
+// header stores. Of the options only the probe limits, open_timeout_ms and the I/O settings apply,
+// VX_OF_AUDIO_ONLY is ignored and both streams are reported.
+vx_error vx_probe(const char* filename, vx_media_info* out_info, const vx_open_options* options);
+vx_error vx_probe_io(vx_read_callback read_cb, vx_seek_callback seek_cb, vx_size_callback size_cb, void* user_data,
+	vx_media_info* out_info, const vx_open_options* options);
+
 int vx_get_width(vx_video* video);
 int vx_get_height(vx_video* video);
 
@@ -71,35 +316,188 @@ int vx_get_audio_sample_rate(vx_video* video);
 int vx_get_audio_channels(vx_video* video);
 const char* vx_get_audio_sample_format_str(vx_video* video);
 
+// With cb set, audio is pushed to cb as it is decoded. With cb NULL it is buffered for vx_read_audio
+// (a NULL cb no longer turns audio off). sample_rate or channels 0 turns audio off, its packets are
+// skipped again. Audio is neither read nor decoded until this is called, it opens the audio decoder
+// the first time.
 vx_error vx_set_audio_params(vx_video* me, int sample_rate, int channels, vx_sample_fmt format, vx_audio_callback cb, void* user_data);
 vx_error vx_set_max_samples_per_frame(vx_video* me, int max_samples);
 
+// Reads up to max_samples samples (per channel, interleaved in the format set with vx_set_audio_params)
+// into buffer, decoding ahead as needed. out_ts is the timestamp of the first sample in seconds.
+// Decoding stops early when video frames are waiting to be read with vx_get_frame, fewer samples are
+// returned then, or VX_ERR_FRAME_DEFERRED if there are none (read the video or open with
+// VX_OF_AUDIO_ONLY). Audio that isn't read stays buffered up to twice the largest max_samples
+// (at least 4 seconds), beyond that the oldest samples are dropped.
+// With an audio callback it decodes about max_samples samples into the callback instead, buffer is
+// unused and out_ts is not set. Returns VX_ERR_EOF once everything is read.
+vx_error vx_read_audio(vx_video* me, void* buffer, int max_samples, int* out_num_samples, double* out_ts);
+
+// Skips all non-key video packets before decoding, vx_get_frame then only returns keyframes.
+// Can be toggled between frames, decoding resumes at the next keyframe.
+vx_error vx_set_keyframes_only(vx_video* me, int enabled);
+
+// Frame sampling, vx_get_frame only returns the sampled video frames. Frames that aren't sampled
+// are never converted or scaled, non-reference frames before the next sample are not decoded and
+// gaps of more than two GOPs are skipped with a seek (not in async mode, and not while audio is
+// decoded, which would lose the audio in the gap).
+// Each call replaces the previous sampling, set it before reading frames or right after a seek.
+// fps: at most fps frames per second of video, 0 disables sampling.
+vx_error vx_set_sample_fps(vx_video* me, double fps);
+// stride: every nth frame, 0 or 1 disables sampling.
+vx_error vx_set_sample_stride(vx_video* me, int stride);
+// timestamps: the first frame at or after each timestamp (in the video stream's time base), once the
+// last one has been delivered vx_get_frame returns VX_ERR_EOF. NULL disables sampling.
+vx_error vx_set_sample_timestamps(vx_video* me, const long long* timestamps, int num_timestamps);
+
+// Defaults to VX_SCALE_FAST_BILINEAR and 1 thread. 0 threads lets swscale decide.
+// With VX_OF_SINGLE_THREAD scaling stays on 1 thread whatever threads says.
+// Threaded scaling requires ffmpeg 5.0 or later, the thread count is ignored otherwise.
+vx_error vx_set_scale_params(vx_video* me, vx_scale_algorithm algorithm, int threads);
+
 long long vx_get_file_position(vx_video* video);
 long long vx_get_file_size(vx_video* video);
 double vx_timestamp_to_seconds(vx_video* video, long long ts);
 
-// Note that you need to re-open the file (create a new vx_video instance) after counting frames.
-// cb can be NULL.
+// Uses the index or the container's frame count when they can be trusted, otherwise reads
+// every video packet from the start of the file and rewinds the video to the start afterwards.
+// With a count callback set the file is always read. out_method can be NULL.
+vx_error vx_count_frames_ex(vx_video* me, int* out_num_frames, vx_count_method* out_method);
 vx_error vx_count_frames(vx_video* me, int* out_num_frames);
+
+// cb is called for every packet (of any stream) read while counting, it can be NULL.
 vx_error vx_set_count_frames_cb(vx_video* me, vx_on_count_frames_callback cb, void* user_data);
 
+// Reads the whole file once and records every video packet, the video is rewound afterwards.
+// With an index, frame counting, duration and seeking no longer need to scan the file. Fails with
+// VX_ERR_INDEX, keeping no index, when damage uses up the recovery budget before the end.
+vx_error vx_build_index(vx_video* me);
+
+// Entries are in file order, NULL if there is no index.
+const vx_index_entry* vx_get_index(vx_video* me, int* out_num_entries);
+
+// The index file records the video's size and a hash of its first and last 64 KiB, and is rejected
+// (VX_ERR_INDEX) when either differs. Edits that keep the size and leave both ends untouched go
+// unnoticed. Both need a seekable input.
+vx_error vx_save_index(vx_video* me, const char* filename);
+vx_error vx_load_index(vx_video* me, const char* filename);
+
+// In async mode the background threads keep their own counters and hand them over with every
+// queued packet or frame, so the totals can be slightly behind the work in progress.
+vx_error vx_get_stats(vx_video* video, vx_stats* out_stats);
+vx_error vx_reset_stats(vx_video* video);
+
 vx_error vx_get_pixel_aspect_ratio(vx_video* video, float* out_par);
 
 vx_error vx_get_frame_rate(vx_video* video, float* out_fps);
 vx_error vx_get_duration(vx_video* video, float* out_duration);
 
 vx_error vx_get_frame(vx_video* video, vx_frame* frame);
+
+// Fills up to max_frames frames (for example from vx_frame_batch_get_frames) with consecutive frames.
+// Returns VX_ERR_SUCCESS when the batch is full or was cut short by the end of the file (the next call
+// returns VX_ERR_EOF), otherwise the error that stopped it. out_num_frames frames are valid either way.
+vx_error vx_get_frames(vx_video* video, vx_frame** frames, int max_frames, int* out_num_frames);
+
+// Returns the next frame as decoded, without scaling or copying. The frame's planes reference the
+// decoder's buffers, which stay valid (even after vx_close) until the frame is passed to
+// vx_frame_destroy. The frame is read-only and has no contiguous buffer (vx_frame_get_buffer returns NULL).
+vx_error vx_get_frame_ref(vx_video* video, vx_frame** out_frame);
+
+// ts is in the video stream's time base (see vx_frame_get_pts and vx_timestamp_to_seconds).
+// Any queued frames are dropped, the next vx_get_frame returns the first frame at the target.
+vx_error vx_seek(vx_video* video, long long ts, int flags);
+
+// pos is a byte offset into the file (see vx_frame_get_byte_pos).
+vx_error vx_seek_byte(vx_video* video, long long pos, int flags);
 const char* vx_get_error_str(vx_error error);
 
 vx_frame* vx_frame_create(int width, int height, vx_pix_fmt pix_fmt);
 void vx_frame_destroy(vx_frame* frame);
 
+// max_frames frames sharing one buffer, frame i starts at i * (the size of one frame), which makes it
+// NHWC for the packed formats. The frames belong to the batch and must not be destroyed on their own.
+vx_frame_batch* vx_frame_batch_create(int max_frames, int width, int height, vx_pix_fmt pix_fmt);
+void vx_frame_batch_destroy(vx_frame_batch* batch);
+vx_frame** vx_frame_batch_get_frames(vx_frame_batch* batch);
+void* vx_frame_batch_get_buffer(vx_frame_batch* batch);
+
+int vx_frame_get_width(vx_frame* frame);
+int vx_frame_get_height(vx_frame* frame);
+vx_pix_fmt vx_frame_get_pix_fmt(vx_frame* frame);
+const char* vx_frame_get_pix_fmt_str(vx_frame* frame);
+
 unsigned int vx_frame_get_flags(vx_frame* frame);
 long long vx_frame_get_byte_pos(vx_frame* frame);
 long long vx_frame_get_dts(vx_frame* frame);
 long long vx_frame_get_pts(vx_frame* frame);
 void* vx_frame_get_buffer(vx_frame* frame);
 
+// The buffer holds the planes back to back without padding. Frames in the decoder's own
+// format and size are copied plane by plane without going through swscale.
+int vx_frame_get_num_planes(vx_frame* frame);
+void* vx_frame_get_plane(vx_frame* frame, int plane);
+int vx_frame_get_stride(vx_frame* frame, int plane);
+
+// Batch engine: decodes many files at once on a pool of worker threads. Jobs are spread over the
+// workers' queues and idle workers steal from the others, so a few long files don't hold up the rest.
+typedef struct vx_batch vx_batch;
+
+// Called on a worker thread for every frame of a job, return 0 to stop the job early.
+// The frame is reused for the next frame.
+typedef int (*vx_batch_frame_callback)(vx_frame* frame, void* user_data);
+
+typedef struct {
+	// a file, or custom input when filename is NULL (see vx_open_io)
+	const char* filename;
+	vx_read_callback read_cb;
+	vx_seek_callback seek_cb;
+	vx_size_callback size_cb;
+	void* io_user_data;
+
+	// can be NULL to only count frames
+	vx_batch_frame_callback frame_cb;
+	void* user_data;
+} vx_batch_job;
+
+typedef struct {
+	// VX_ERR_SUCCESS when the job ran to the end of the file or was stopped by its callback
+	vx_error error;
+	int num_frames;
+} vx_batch_result;
+
+typedef struct {
+	// 0 for one per cpu core
+	int num_workers;
+
+	// decoder threads per file, 0 spreads the cores over the files being decoded
+	int decoder_threads;
+
+	// frame format passed to the callbacks, width and height 0 for each video's own size
+	int width;
+	int height;
+	vx_pix_fmt pix_fmt;
+
+	// used for every file, thread_count is set per file from decoder_threads
+	vx_open_options open_options;
+} vx_batch_options;
+
+// Sets all options to their defaults (VX_PIX_FMT_RGB24), call before changing individual options.
+void vx_batch_options_init(vx_batch_options* options);
+
+// options can be NULL for the defaults.
+vx_error vx_batch_create(vx_batch** batch, const vx_batch_options* options);
+
+// Queues num_jobs jobs and returns immediately. The jobs are copied, results[i] is filled in when
+// job i is done and must stay valid until then (see vx_batch_wait).
+vx_error vx_batch_submit(vx_batch* batch, const vx_batch_job* jobs, vx_batch_result* results, int num_jobs);
+
+// Blocks until every submitted job is done.
+void vx_batch_wait(vx_batch* batch);
+
+// Waits for the submitted jobs, then stops the workers.
+void vx_batch_destroy(vx_batch* batch);
+
 #ifdef __cplusplus
 }
 #endif
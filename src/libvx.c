@@ -1,10 +1,30 @@
+// pread, posix_fadvise and posix_madvise under -std=c99
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #include <libavcodec/avcodec.h>
 #include <libavutil/mathematics.h>
 #include <libavutil/pixfmt.h>
+#include <libavutil/opt.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
 #include <libswscale/swscale.h>
 #include <libavformat/avformat.h>
 #include <libswresample/swresample.h>
@@ -34,17 +54,117 @@ struct vx_frame
 	int width, height;
 	vx_pix_fmt pix_fmt;
 
+	// planes point into buffer, or into ref for frames from vx_get_frame_ref
+	void* buffer;
+	uint8_t* planes[4];
+	int strides[4];
+
+	AVFrame* ref;
+};
+
+struct vx_frame_batch
+{
+	int max_frames;
 	void* buffer;
+
+	vx_frame* frames;
+	vx_frame** frame_ptrs;
 };
 
 typedef struct vx_frame_queue_item
 {
 	vx_frame_info info;
 	AVFrame* frame;
+
+	// already converted by the async pipeline, or NULL
+	vx_frame* scaled;
 } vx_frame_queue_item;
 
 #define FRAME_QUEUE_SIZE 16 
 
+// decoded frames in flight are either queued, being decoded into or being scaled from, the async
+// pipeline adds its own queue on top (see vx_alloc)
+#define FRAME_POOL_SIZE (FRAME_QUEUE_SIZE + 4)
+
+typedef struct vx_scaler
+{
+	struct SwsContext* ctx;
+
+	int src_width, src_height, src_format;
+	int dst_width, dst_height, dst_format;
+	int flags, threads;
+} vx_scaler;
+
+#define ASYNC_PACKET_QUEUE_SIZE 64
+
+// corruption recovery skips double from the min to the max skip while the errors keep coming,
+// every skip searches up to RESYNC_SCAN_SIZE bytes for a sync point
+#define RESYNC_MIN_SKIP 512
+#define RESYNC_MAX_SKIP (8 * 1024 * 1024)
+#define RESYNC_SCAN_SIZE (1024 * 1024)
+
+typedef struct vx_async_item
+{
+	vx_frame_info info;
+	AVFrame* frame;
+	vx_frame* scaled;
+	int stream_idx;
+	vx_error error;
+} vx_async_item;
+
+typedef enum {
+	VX_SAMPLE_NONE,
+	VX_SAMPLE_FPS,
+	VX_SAMPLE_STRIDE,
+	VX_SAMPLE_TIMESTAMPS
+} vx_sample_mode;
+
+// background demux and decode threads, see vx_async_start
+typedef struct vx_async
+{
+	bool running;
+	bool abort;
+
+	pthread_t demux_thread;
+	pthread_t decode_thread;
+
+	// guards everything below, cond is broadcast on every change
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	// demux thread -> decode thread
+	AVPacket* packets[ASYNC_PACKET_QUEUE_SIZE];
+	int packet_head, num_packets;
+	bool demux_eof;
+	bool skip_request;
+
+	// decode thread -> vx_get_frame, one slot more than item_capacity for a frame decoded as the pipeline stops
+	vx_async_item* items;
+	int item_capacity, item_slots, item_head, num_items;
+
+	// items moved out in one go by vx_async_pop, only used by the caller's thread
+	vx_async_item taken[FRAME_QUEUE_SIZE];
+	int taken_head, num_taken;
+
+	// output format of the last vx_get_frame, frames are converted ahead of time when known
+	int width, height;
+	vx_pix_fmt pix_fmt;
+	vx_scaler scaler;
+
+	vx_frame** scaled_pool;
+	int scaled_pool_capacity, num_scaled_pool;
+
+	// counted by the pipeline threads, folded in from their own blocks at every push
+	vx_stats stats;
+} vx_async;
+
+// counters of a pipeline thread, see vx_thread_stats
+typedef struct vx_pipeline_stats
+{
+	vx_video* owner;
+	vx_stats stats;
+} vx_pipeline_stats;
+
 struct vx_video
 {
 	AVFormatContext* fmt_ctx;
@@ -61,6 +181,8 @@ struct vx_video
 	int out_channels;
 	vx_sample_fmt out_sample_format;
 
+	// set by vx_set_audio_params, audio packets are skipped until then
+	bool audio_enabled;
 	vx_audio_callback audio_cb;
 	void* audio_user_data;
 
@@ -74,22 +196,259 @@ struct vx_video
 	int max_samples;
 	int samples_since_last_frame;
 
+	// resampled audio for vx_read_audio when there is no audio callback, ts is the first sample's
+	uint8_t* audio_ring;
+	int audio_ring_capacity;
+	int audio_ring_head, audio_ring_count;
+	int audio_ring_sample_size;
+	double audio_ring_ts;
+
+	// total samples passed to the audio callback
+	int64_t audio_samples_delivered;
+
 	int num_queue;
 	vx_frame_queue_item frame_queue[FRAME_QUEUE_SIZE + 1];
 
+	// recycled frames and the one packet used for all reads
+	int num_frame_pool, frame_pool_capacity;
+	AVFrame** frame_pool;
+	AVPacket* packet;
+
+	vx_stats stats;
+	vx_async async;
+
+	// file protocol counters at the last vx_reset_stats
+	int64_t io_bytes_base;
+	int64_t io_seeks_base;
+
 	vx_on_count_frames_callback count_frames_cb;
 	void* count_frames_user_data;
 
+	vx_scaler scaler;
+	vx_scale_algorithm scale_algorithm;
+	int scale_threads;
+
+	bool keyframes_only;
+
+	// frame sampling, see vx_set_sample_fps/stride/timestamps
+	vx_sample_mode sample_mode;
+	double sample_interval;
+	double sample_next;
+	int sample_stride;
+	int64_t sample_count;
+	int64_t* sample_timestamps;
+	int num_sample_timestamps;
+	int sample_timestamp_idx;
+	bool sample_restart;
+
+	// longest keyframe distance seen so far, for deciding when seeking beats decoding
+	int64_t gop_pts;
+	int64_t last_key_pts;
+	bool sample_seekable;
+
+	// packet index, built by vx_build_index or loaded with vx_load_index
+	vx_index_entry* index;
+	int num_index;
+	int index_capacity;
+
+	// set by vx_seek/vx_seek_byte, see vx_before_seek_target
+	int64_t seek_target_pts;
+	bool seek_to_keyframe;
+
+	// stream whose decoder was last fed a packet and may still hold frames, -1 if none
+	int pending_stream;
+	bool flushing;
+
 	vx_error decoding_error;
-	int open_flags;
+	vx_open_options options;
+
+	// custom input, see vx_open_io and vx_open_mem
+	AVIOContext* avio;
+	vx_read_callback io_read;
+	vx_seek_callback io_seek;
+	vx_size_callback io_size;
+	void* io_user_data;
+
+	// vx_open_mem, or the file for VX_IO_PREAD/MMAP
+	const uint8_t* mem;
+	int64_t mem_size;
+	int64_t mem_pos;
+	int fd;
+
+	// vx_probe, the container only without any decoders
+	bool probe_only;
+
+	// corruption recovery, see vx_resync. Owned by whoever reads packets, the demux thread
+	// when the async pipeline is running, except recovery_exhausted which is under async.lock.
+	int64_t resync_skip;
+	int64_t resync_last_pos;
+	int64_t resync_burst_start;
+	int64_t recovery_bytes;
+	int64_t recovery_us;
+	bool recovery_exhausted;
+
+	// vx_cancel and call deadlines (av_gettime_relative, 0 outside of calls), checked by ffmpeg's
+	// interrupt callback from any thread
+	pthread_mutex_t interrupt_lock;
+	bool cancelled;
+	int64_t deadline;
+	int timeout_ms;
+
+	// whether the deadline also interrupts ffmpeg's I/O, only for calls that reposition the file
+	// afterwards anyway, an interrupted read leaves the AVIOContext at eof until the next seek
+	bool io_deadline;
 };
 
+static void vx_async_halt(vx_video* me);
+static void vx_async_discard(vx_video* me);
+static void vx_async_stop(vx_video* me);
+static void vx_async_free(vx_video* me);
+static int vx_main_stream(vx_video* me);
+static vx_error vx_audio_init_resampler(vx_video* me);
+
+static pthread_once_t vx_stats_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t vx_stats_key;
+
+static void vx_stats_key_create(void)
+{
+	pthread_key_create(&vx_stats_key, NULL);
+}
+
+// The counters of the calling thread. The demux and decode threads count into blocks of their own
+// (see vx_async_fold_stats), everything else runs on the caller's thread and counts into vx_thread_stats(me)->
+static vx_stats* vx_thread_stats(vx_video* me)
+{
+	pthread_once(&vx_stats_key_once, vx_stats_key_create);
+
+	vx_pipeline_stats* ps = pthread_getspecific(vx_stats_key);
+
+	return ps && ps->owner == me ? &ps->stats : &me->stats;
+}
+
+static void vx_stats_add(vx_stats* to, const vx_stats* from)
+{
+	to->frame_allocs += from->frame_allocs;
+	to->frame_reuses += from->frame_reuses;
+	to->io_bytes_read += from->io_bytes_read;
+	to->io_reads += from->io_reads;
+	to->io_seeks += from->io_seeks;
+	to->open_us += from->open_us;
+	to->probe_us += from->probe_us;
+	to->read_us += from->read_us;
+	to->decode_us += from->decode_us;
+	to->hw_transfer_us += from->hw_transfer_us;
+	to->scale_us += from->scale_us;
+	to->audio_us += from->audio_us;
+	to->output_copy_us += from->output_copy_us;
+	to->packets_read += from->packets_read;
+	to->packets_discarded += from->packets_discarded;
+	to->frames_decoded += from->frames_decoded;
+	to->hw_transfers += from->hw_transfers;
+	to->scale_calls += from->scale_calls;
+	to->audio_frames += from->audio_frames;
+	to->read_errors += from->read_errors;
+	to->decode_errors += from->decode_errors;
+	to->recovery_seeks += from->recovery_seeks;
+	to->recovery_bytes += from->recovery_bytes;
+	to->recovery_us += from->recovery_us;
+	to->sync_points += from->sync_points;
+	to->frames_deferred += from->frames_deferred;
+	to->audio_samples_dropped += from->audio_samples_dropped;
+	to->queue_high_water = FFMAX(to->queue_high_water, from->queue_high_water);
+}
+
+static enum AVSampleFormat vx_to_av_sample_fmt(vx_sample_fmt fmt)
+{
+	return fmt == VX_SAMPLE_FMT_FLT ? AV_SAMPLE_FMT_FLT : AV_SAMPLE_FMT_S16;
+}
+
 static enum AVPixelFormat vx_to_av_pix_fmt(vx_pix_fmt fmt)
 {
-	enum AVPixelFormat formats[] = {AV_PIX_FMT_RGB24, AV_PIX_FMT_GRAY8, AV_PIX_FMT_BGRA};
+	enum AVPixelFormat formats[] = {AV_PIX_FMT_RGB24, AV_PIX_FMT_GRAY8, AV_PIX_FMT_BGRA,
+		AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12, AV_PIX_FMT_GRAY16, AV_PIX_FMT_GBRP};
 	return formats[fmt];
 }
 
+static vx_pix_fmt vx_from_av_pix_fmt(int fmt)
+{
+	for(vx_pix_fmt i = VX_PIX_FMT_RGB24; i <= VX_PIX_FMT_GBRP; i++){
+		if(vx_to_av_pix_fmt(i) == fmt)
+			return i;
+	}
+
+	return VX_PIX_FMT_UNKNOWN;
+}
+
+// native format of frames from vx_get_frame_ref, which may not have a vx_pix_fmt
+static int vx_frame_av_pix_fmt(vx_frame* me)
+{
+	return me->ref ? me->ref->format : vx_to_av_pix_fmt(me->pix_fmt);
+}
+
+static int vx_to_sws_flags(vx_scale_algorithm algorithm)
+{
+	int flags[] = {SWS_FAST_BILINEAR, SWS_BILINEAR, SWS_AREA, SWS_BICUBIC};
+	return flags[algorithm];
+}
+
+static void vx_scaler_free(vx_scaler* me)
+{
+	if(me->ctx)
+		sws_freeContext(me->ctx);
+
+	memset(me, 0, sizeof(vx_scaler));
+}
+
+static struct SwsContext* vx_scaler_get(vx_scaler* me, int src_width, int src_height, int src_format,
+	int dst_width, int dst_height, int dst_format, int flags, int threads)
+{
+	// reuse the scaler as long as the geometry and settings stay the same
+	if(me->ctx && me->src_width == src_width && me->src_height == src_height && me->src_format == src_format
+		&& me->dst_width == dst_width && me->dst_height == dst_height && me->dst_format == dst_format
+		&& me->flags == flags && me->threads == threads)
+	{
+		return me->ctx;
+	}
+
+	dprintf("creating scaler: %dx%d (%d) -> %dx%d (%d)\n", src_width, src_height, src_format, dst_width, dst_height, dst_format);
+	vx_scaler_free(me);
+
+	struct SwsContext* ctx = sws_alloc_context();
+
+	if(!ctx)
+		return NULL;
+
+	av_opt_set_int(ctx, "srcw", src_width, 0);
+	av_opt_set_int(ctx, "srch", src_height, 0);
+	av_opt_set_int(ctx, "src_format", src_format, 0);
+	av_opt_set_int(ctx, "dstw", dst_width, 0);
+	av_opt_set_int(ctx, "dsth", dst_height, 0);
+	av_opt_set_int(ctx, "dst_format", dst_format, 0);
+	av_opt_set_int(ctx, "sws_flags", flags, 0);
+
+#if LIBSWSCALE_VERSION_MAJOR >= 6
+	// swscale only supports threading from ffmpeg 5.0 and up
+	av_opt_set_int(ctx, "threads", threads, 0);
+#endif
+
+	if(sws_init_context(ctx, NULL, NULL) < 0){
+		sws_freeContext(ctx);
+		return NULL;
+	}
+
+	me->ctx = ctx;
+	me->src_width = src_width;
+	me->src_height = src_height;
+	me->src_format = src_format;
+	me->dst_width = dst_width;
+	me->dst_height = dst_height;
+	me->dst_format = dst_format;
+	me->flags = flags;
+	me->threads = threads;
+
+	return ctx;
+}
+
 static int vx_enqueue_qsort_fn(const void* a, const void* b)
 {
 	return ((vx_frame_queue_item*)b)->info.pts - ((vx_frame_queue_item*)a)->info.pts;
@@ -98,6 +457,8 @@ static int vx_enqueue_qsort_fn(const void* a, const void* b)
 static void vx_enqueue(vx_video* me, vx_frame_queue_item item)
 {
 	me->frame_queue[me->num_queue++] = item;
+	vx_stats* stats = vx_thread_stats(me);
+	stats->queue_high_water = FFMAX(stats->queue_high_water, me->num_queue);
 	qsort(me->frame_queue, me->num_queue, sizeof(vx_frame_queue_item), vx_enqueue_qsort_fn);
 }
 
@@ -106,27 +467,77 @@ static vx_frame_queue_item vx_dequeue(vx_video* me)
 	return me->frame_queue[--me->num_queue];
 }
 
+// the pool is shared with the decode thread while the async pipeline is running
+static void vx_frame_pool_lock(vx_video* me)
+{
+	if(me->async.running)
+		pthread_mutex_lock(&me->async.lock);
+}
+
+static void vx_frame_pool_unlock(vx_video* me)
+{
+	if(me->async.running)
+		pthread_mutex_unlock(&me->async.lock);
+}
+
+static AVFrame* vx_frame_pool_get(vx_video* me)
+{
+	AVFrame* frame = NULL;
+
+	vx_frame_pool_lock(me);
+
+	if(me->num_frame_pool > 0){
+		vx_thread_stats(me)->frame_reuses++;
+		frame = me->frame_pool[--me->num_frame_pool];
+	}
+
+	else{
+		vx_thread_stats(me)->frame_allocs++;
+	}
+
+	vx_frame_pool_unlock(me);
+
+	return frame ? frame : av_frame_alloc();
+}
+
+static void vx_frame_pool_put(vx_video* me, AVFrame* frame)
+{
+	av_frame_unref(frame);
+
+	vx_frame_pool_lock(me);
+
+	if(me->num_frame_pool < me->frame_pool_capacity){
+		me->frame_pool[me->num_frame_pool++] = frame;
+		frame = NULL;
+	}
+
+	vx_frame_pool_unlock(me);
+
+	if(frame)
+		av_frame_free(&frame);
+}
+
 static bool use_hw(vx_video* me, AVCodec* codec)
 {
-	if(me->open_flags & VX_OF_HW_ACCEL_ALL)
+	if(me->options.flags & VX_OF_HW_ACCEL_ALL)
 		return true;
 	
-	if(me->open_flags & VX_OF_HW_ACCEL_720 && vx_get_height(me) >= 720)
+	if(me->options.flags & VX_OF_HW_ACCEL_720 && vx_get_height(me) >= 720)
 		return true;
 	
-	if(me->open_flags & VX_OF_HW_ACCEL_1080 && vx_get_height(me) >= 1080)
+	if(me->options.flags & VX_OF_HW_ACCEL_1080 && vx_get_height(me) >= 1080)
 		return true;
 	
-	if(me->open_flags & VX_OF_HW_ACCEL_1440 && vx_get_height(me) >= 1440)
+	if(me->options.flags & VX_OF_HW_ACCEL_1440 && vx_get_height(me) >= 1440)
 		return true;
 	
-	if(me->open_flags & VX_OF_HW_ACCEL_2160 && vx_get_height(me) >= 2160)
+	if(me->options.flags & VX_OF_HW_ACCEL_2160 && vx_get_height(me) >= 2160)
 		return true;
 
-	if(me->open_flags & VX_OF_HW_ACCEL_HEVC && codec->id == AV_CODEC_ID_HEVC)
+	if(me->options.flags & VX_OF_HW_ACCEL_HEVC && codec->id == AV_CODEC_ID_HEVC)
 		return true;
 	
-	if(me->open_flags & VX_OF_HW_ACCEL_H264 && codec->id == AV_CODEC_ID_H264)
+	if(me->options.flags & VX_OF_HW_ACCEL_H264 && codec->id == AV_CODEC_ID_H264)
 		return true;
 
 	return false;
@@ -184,12 +595,28 @@ static int hw_decoder_init(vx_video* me, AVCodecContext *ctx, const enum AVHWDev
 	return err;
 }
 
-static bool find_stream_and_open_codec(vx_video* me, enum AVMediaType type,
-	int* out_stream, AVCodecContext** out_codec_ctx, vx_error* out_error)
+static void vx_set_decoder_threads(vx_video* me, AVCodecContext* ctx)
 {
-	AVCodec* codec;
+	// everything for this instance runs on the calling thread
+	if(me->options.flags & VX_OF_SINGLE_THREAD){
+		ctx->thread_count = 1;
+		return;
+	}
+
+	// 0 lets ffmpeg pick one thread per core
+	ctx->thread_count = me->options.thread_count;
 
-	*out_stream = av_find_best_stream(me->fmt_ctx, type, -1, -1, &codec, 0);
+	if(me->options.thread_type == VX_THREAD_FRAME)
+		ctx->thread_type = FF_THREAD_FRAME;
+	else if(me->options.thread_type == VX_THREAD_SLICE)
+		ctx->thread_type = FF_THREAD_SLICE;
+	else
+		ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+}
+
+static bool find_stream(vx_video* me, enum AVMediaType type, int* out_stream, AVCodec** out_codec, vx_error* out_error)
+{
+	*out_stream = av_find_best_stream(me->fmt_ctx, type, -1, -1, out_codec, 0);
 
 	if(*out_stream < 0)
 	{
@@ -202,8 +629,28 @@ static bool find_stream_and_open_codec(vx_video* me, enum AVMediaType type,
 		return false;
 	}
 
-	// Get a pointer to the codec context for the video stream
-	*out_codec_ctx = me->fmt_ctx->streams[*out_stream]->codec;
+	return true;
+}
+
+static bool open_codec(vx_video* me, enum AVMediaType type, AVCodec* codec,
+	int* out_stream, AVCodecContext** out_codec_ctx, vx_error* out_error)
+{
+	AVStream* stream = me->fmt_ctx->streams[*out_stream];
+
+	// Allocate a codec context for the stream, vx_close frees it even if opening fails further down
+	*out_codec_ctx = avcodec_alloc_context3(codec);
+
+	if(!*out_codec_ctx){
+		*out_error = VX_ERR_ALLOCATE;
+		goto error;
+	}
+
+	if(avcodec_parameters_to_context(*out_codec_ctx, stream->codecpar) < 0){
+		*out_error = VX_ERR_OPEN_CODEC;
+		goto error;
+	}
+
+	(*out_codec_ctx)->pkt_timebase = stream->time_base;
 
 	// Find and enable any hardware acceleration support
 	const AVCodecHWConfig *hw_config = use_hw(me, codec) ? get_hw_config(codec) : NULL;
@@ -214,479 +661,3028 @@ static bool find_stream_and_open_codec(vx_video* me, enum AVMediaType type,
 		me->hw_pix_fmt = hw_config->pix_fmt;
 	}
 
+	if(type == AVMEDIA_TYPE_VIDEO)
+		vx_set_decoder_threads(me, *out_codec_ctx);
+
 	// Open codec
 	if(avcodec_open2(*out_codec_ctx, codec, NULL) < 0)
 	{
 		*out_error = VX_ERR_OPEN_CODEC;
-		return false;
+		goto error;
 	}
 
 	return true;
+
+error:
+	if(*out_codec_ctx)
+		avcodec_free_context(out_codec_ctx);
+
+	*out_stream = -1;
+	return false;
 }
 
-vx_error vx_open(vx_video** video, const char* filename, int flags)
+static bool find_stream_and_open_codec(vx_video* me, enum AVMediaType type,
+	int* out_stream, AVCodecContext** out_codec_ctx, vx_error* out_error)
 {
-	if(!initialized){
-		initialized = true;
-	}
-
-	vx_video* me = calloc(1, sizeof(vx_video));
+	AVCodec* codec;
 
-	if(!me)
-		return VX_ERR_ALLOCATE;
+	return find_stream(me, type, out_stream, &codec, out_error) &&
+		open_codec(me, type, codec, out_stream, out_codec_ctx, out_error);
+}
 
-	me->hw_pix_fmt = AV_PIX_FMT_NONE;
-	me->open_flags = flags;
-	
-	vx_error error = VX_ERR_UNKNOWN;
+// only the streams that are decoded reach vx_read_frame, the demuxer skips the rest without allocating packets
+static void vx_update_stream_discard(vx_video* me)
+{
+	for(unsigned i = 0; i < me->fmt_ctx->nb_streams; i++){
+		bool used = ((int)i == me->video_stream && me->video_codec_ctx) ||
+			((int)i == me->audio_stream && me->audio_codec_ctx && me->audio_enabled);
 
-	// open stream
-	if(avformat_open_input(&me->fmt_ctx, filename, NULL, NULL) != 0){
-		error = VX_ERR_OPEN_FILE;
-		goto cleanup;
+		me->fmt_ctx->streams[i]->discard = used ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
 	}
+}
 
-	// Get stream information
-	if(avformat_find_stream_info(me->fmt_ctx, /*&options*/ NULL) < 0){
-		error = VX_ERR_STREAM_INFO;
-		goto cleanup;
-	}
-	
-	// find video and audio streams and open respective codecs
-	if(!find_stream_and_open_codec(me, AVMEDIA_TYPE_VIDEO, &me->video_stream, &me->video_codec_ctx, &error)){
-		goto cleanup;
-	}
+// packets that are decoded, everything else is dropped right after reading
+static bool vx_wants_packet(vx_video* me, int stream_idx)
+{
+	if(stream_idx < 0)
+		return false;
 
-	if(!find_stream_and_open_codec(me, AVMEDIA_TYPE_AUDIO, &me->audio_stream, &me->audio_codec_ctx, &error)){
-		dprintf("no audio stream\n");
-	}
-	
-	// reference counted frames for video codec so they can be queued without cloning
-	me->video_codec_ctx->refcounted_frames = 1;
-	
-	*video = me;
-	return VX_ERR_SUCCESS;
+	if(stream_idx == me->video_stream)
+		return me->video_codec_ctx != NULL;
 
-cleanup:
-	vx_close(me);
-	return error;
+	if(stream_idx == me->audio_stream)
+		return me->audio_codec_ctx && me->audio_enabled;
+
+	return false;
 }
 
-void vx_close(vx_video* me)
+void vx_open_options_init(vx_open_options* options)
 {
-	assert(me);
+	assert(options);
 
-	if(me->swr_ctx)
-		swr_free(&me->swr_ctx);
+	memset(options, 0, sizeof(vx_open_options));
+	options->thread_count = 0;
+	options->thread_type = VX_THREAD_AUTO;
+	options->recovery_max_bytes = 64 * 1024 * 1024;
+	options->recovery_max_ms = 10000;
+}
 
-	if(me->fmt_ctx)
-		avformat_free_context(me->fmt_ctx);
+vx_error vx_open(vx_video** video, const char* filename, int flags)
+{
+	vx_open_options options;
+	vx_open_options_init(&options);
+	options.flags = flags;
 
-	// already freed by avformat_free_context?
-	//if(me->video_codec_ctx && avcodec_is_open(me->video_codec_ctx))
-	//	avcodec_close(me->video_codec_ctx);
+	// one decoder thread, as vx_open always did
+	options.thread_count = 1;
 
-	for(int i = 0; i < me->num_queue; i++){
-		av_frame_unref(me->frame_queue[i].frame);
-		av_frame_free(&me->frame_queue[i].frame);
-	}
-	
-	free(me);
+	return vx_open_ex(video, filename, &options);
 }
 
-static bool vx_read_frame(AVFormatContext* fmt_ctx, AVPacket* packet, int stream)
+static vx_video* vx_alloc(const vx_open_options* options)
 {
-	// try to read a frame, if it can't be read, skip ahead a bit and try again
-	int64_t last_fp = avio_tell(fmt_ctx->pb);
-
-	for(int i = 0; i < 1024; i++){
-		int ret = av_read_frame(fmt_ctx, packet);
-
-		// success
-		if(ret == 0)
-			return true;
+	if(!initialized){
+		initialized = true;
+	}
 
-		// eof, no need to retry
-		if(ret == AVERROR_EOF || avio_feof(fmt_ctx->pb))
-			return false;
+	vx_video* me = calloc(1, sizeof(vx_video));
 
-		// other error, might be a damaged stream, seek forward a couple bytes and try again
-		if((i % 10) == 0){
-			int64_t fp = avio_tell(fmt_ctx->pb);
+	if(!me)
+		return NULL;
 
-			if(fp <= last_fp)
-				fp = last_fp + 100 * i;
+	pthread_mutex_init(&me->async.lock, NULL);
+	pthread_cond_init(&me->async.cond, NULL);
+	pthread_mutex_init(&me->interrupt_lock, NULL);
 
-			dprintf("retry: @%" PRId64 "\n", fp);
-			avformat_seek_file(fmt_ctx, stream, fp + 100, fp + 512, fp + 1024 * 1024, AVSEEK_FLAG_BYTE | AVSEEK_FLAG_ANY);
+	if(options)
+		me->options = *options;
+	else
+		vx_open_options_init(&me->options);
 
-			last_fp = fp;
-		}
+	me->hw_pix_fmt = AV_PIX_FMT_NONE;
+	me->pending_stream = -1;
+	me->seek_target_pts = AV_NOPTS_VALUE;
+	me->last_key_pts = AV_NOPTS_VALUE;
+	me->sample_seekable = true;
+	me->scale_algorithm = VX_SCALE_FAST_BILINEAR;
+	me->scale_threads = 1;
+	me->fd = -1;
+	me->resync_skip = RESYNC_MIN_SKIP;
+	me->resync_last_pos = -1;
+
+	// every frame in the async queue (plus the spare slot, see vx_async) is a frame in flight too
+	me->frame_pool_capacity = FRAME_POOL_SIZE + (me->options.async_frames > 0 ? me->options.async_frames + 1 : 0);
+	me->frame_pool = calloc(me->frame_pool_capacity, sizeof(AVFrame*));
+	me->packet = av_packet_alloc();
+
+	if(!me->frame_pool || !me->packet){
+		vx_close(me);
+		return NULL;
 	}
 
-	return false;
+	return me;
 }
 
-vx_error vx_set_count_frames_cb(vx_video* me, vx_on_count_frames_callback cb, void* user_data)
+// timeout_ms from now, 0 clears the deadline
+static void vx_set_deadline(vx_video* me, int timeout_ms, bool io)
 {
-	assert(me);
-
-	me->count_frames_cb = cb;
-	me->count_frames_user_data = user_data;
-
-	return VX_ERR_SUCCESS;
+	pthread_mutex_lock(&me->interrupt_lock);
+	me->deadline = timeout_ms > 0 ? av_gettime_relative() + timeout_ms * (int64_t)1000 : 0;
+	me->io_deadline = io;
+	pthread_mutex_unlock(&me->interrupt_lock);
 }
 
-vx_error vx_count_frames(vx_video* me, int* out_num_frames)
+static bool vx_async_is_running(vx_video* me)
 {
-	assert(me);
-
-	int num_frames = 0;
+	pthread_mutex_lock(&me->async.lock);
+	bool running = me->async.running;
+	pthread_mutex_unlock(&me->async.lock);
 
-	AVPacket packet;
-
-	while(true){
-		memset(&packet, 0, sizeof(packet));
+	return running;
+}
 
-		if(!vx_read_frame(me->fmt_ctx, &packet, me->video_stream)){
-			break;
-		}
+// true while vx_async_halt is waiting for the pipeline threads to return
+static bool vx_async_is_aborting(vx_video* me)
+{
+	pthread_mutex_lock(&me->async.lock);
+	bool aborting = me->async.running && me->async.abort;
+	pthread_mutex_unlock(&me->async.lock);
 
-		if(packet.stream_index == me->video_stream){
-			num_frames++;
-		}
-			
-		if(me->count_frames_cb){
-			me->count_frames_cb(packet.stream_index, me->count_frames_user_data);
-		}
+	return aborting;
+}
 
-		av_free_packet(&packet);
-	}
+// VX_ERR_CANCELLED after vx_cancel, VX_ERR_TIMEOUT past the deadline of the current call
+static vx_error vx_interrupted(vx_video* me)
+{
+	pthread_mutex_lock(&me->interrupt_lock);
+	bool cancelled = me->cancelled;
+	int64_t deadline = me->deadline;
+	pthread_mutex_unlock(&me->interrupt_lock);
 
-	if(packet.data)
-		av_free_packet(&packet);
+	if(cancelled)
+		return VX_ERR_CANCELLED;
 
-	*out_num_frames = num_frames;
+	if(deadline > 0 && av_gettime_relative() >= deadline)
+		return VX_ERR_TIMEOUT;
 
 	return VX_ERR_SUCCESS;
 }
 
-
-int vx_get_width(vx_video* me)
+// Whether ffmpeg's blocking I/O should stop: after vx_cancel, or past the deadline of a call that
+// seeks afterwards. Frame and audio calls check their deadline between packets instead, see
+// vx_decode_interrupted.
+static bool vx_check_interrupt(vx_video* me)
 {
-	return me->video_codec_ctx->width;
-}
+	pthread_mutex_lock(&me->interrupt_lock);
+	bool io_deadline = me->io_deadline;
+	pthread_mutex_unlock(&me->interrupt_lock);
 
-int vx_get_height(vx_video* me)
-{
-	return me->video_codec_ctx->height;
+	vx_error err = vx_interrupted(me);
+
+	return err == VX_ERR_CANCELLED || (err == VX_ERR_TIMEOUT && io_deadline);
 }
 
-long long vx_get_file_position(vx_video* video)
+// Checked by the decode loop between packets where stopping loses nothing. The async threads only
+// stop for vx_cancel, a deadline ends the caller's wait for them instead (see vx_async_pop).
+static vx_error vx_decode_interrupted(vx_video* me)
 {
-	return video->fmt_ctx->pb->pos; 
+	vx_error err = vx_interrupted(me);
+
+	if(err == VX_ERR_TIMEOUT && vx_async_is_running(me))
+		return VX_ERR_SUCCESS;
+
+	return err;
 }
 
-long long vx_get_file_size(vx_video* video)
+static int vx_interrupt_cb(void* opaque)
 {
-	return avio_size(video->fmt_ctx->pb);
+	return vx_check_interrupt(opaque) ? 1 : 0;
 }
 
-int vx_get_audio_sample_rate(vx_video* me)
+// every public call that can block starts with vx_begin_call and returns through vx_end_call,
+// io for calls whose I/O may be interrupted by the deadline
+static vx_error vx_begin_call(vx_video* me, bool io)
 {
-	if(!me->audio_codec_ctx)
-		return 0;
-	
-	return me->audio_codec_ctx->sample_rate;
+	vx_set_deadline(me, me->timeout_ms, io);
+	return vx_interrupted(me);
 }
 
-int vx_get_audio_present(vx_video* me)
+static vx_error vx_end_call(vx_video* me, vx_error ret)
 {
-	return me->audio_codec_ctx ? 1 : 0;
-}
+	if(ret != VX_ERR_SUCCESS && ret != VX_ERR_FRAME_DEFERRED){
+		vx_error interrupted = vx_interrupted(me);
 
-int vx_get_audio_channels(vx_video* me)
+		if(interrupted != VX_ERR_SUCCESS)
+			ret = interrupted;
+	}
+
+	vx_set_deadline(me, 0, false);
+	return ret;
+}
+
+void vx_cancel(vx_video* me)
+{
+	assert(me);
+
+	pthread_mutex_lock(&me->interrupt_lock);
+	me->cancelled = true;
+	pthread_mutex_unlock(&me->interrupt_lock);
+
+	// wake up a caller waiting on the async pipeline
+	pthread_mutex_lock(&me->async.lock);
+	pthread_cond_broadcast(&me->async.cond);
+	pthread_mutex_unlock(&me->async.lock);
+}
+
+vx_error vx_set_timeout(vx_video* me, int timeout_ms)
+{
+	assert(me);
+
+	me->timeout_ms = timeout_ms > 0 ? timeout_ms : 0;
+	return VX_ERR_SUCCESS;
+}
+
+// true when the header describes the stream well enough to open a decoder for it
+static bool vx_stream_header_complete(vx_video* me, enum AVMediaType type, bool required)
+{
+	int stream = av_find_best_stream(me->fmt_ctx, type, -1, -1, NULL, 0);
+
+	if(stream < 0)
+		return !required;
+
+	AVCodecParameters* par = me->fmt_ctx->streams[stream]->codecpar;
+
+	if(par->codec_id == AV_CODEC_ID_NONE)
+		return false;
+
+	if(type == AVMEDIA_TYPE_VIDEO)
+		return par->width > 0 && par->height > 0;
+
+	return par->sample_rate > 0 && par->channels > 0;
+}
+
+// Fast open (and vx_probe): streams that may show up after the header, or incomplete parameters
+// still need the analysis, but only of the streams that are going to be used.
+static bool vx_need_stream_info(vx_video* me)
+{
+	if(!(me->options.flags & VX_OF_FAST_OPEN) && !me->probe_only)
+		return true;
+
+	if(me->fmt_ctx->nb_streams == 0 || (me->fmt_ctx->ctx_flags & AVFMTCTX_NOHEADER))
+		return true;
+
+	// vx_probe reports on video and audio whatever the flags say
+	bool audio_only = (me->options.flags & VX_OF_AUDIO_ONLY) && !me->probe_only;
+
+	// a probed file doesn't have to have video
+	bool complete = vx_stream_header_complete(me, AVMEDIA_TYPE_AUDIO, audio_only) &&
+		(audio_only || vx_stream_header_complete(me, AVMEDIA_TYPE_VIDEO, !me->probe_only));
+
+	if(complete)
+		return false;
+
+	int video = audio_only ? -1 : av_find_best_stream(me->fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+	int audio = av_find_best_stream(me->fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+
+	// nothing recognizable yet, analyze everything
+	if(video < 0 && audio < 0)
+		return true;
+
+	for(unsigned i = 0; i < me->fmt_ctx->nb_streams; i++){
+		if((int)i != video && (int)i != audio)
+			me->fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+	}
+
+	return true;
+}
+
+// opens the input (a file name, or me->fmt_ctx with a custom pb), closes me on failure
+static vx_error vx_open_input(vx_video** video, vx_video* me, const char* filename)
+{
+	vx_error error = VX_ERR_UNKNOWN;
+	int64_t start = av_gettime_relative();
+	AVDictionary* format_opts = NULL;
+
+	vx_set_deadline(me, me->options.open_timeout_ms, true);
+
+	// custom input comes with a context already, files need one for the interrupt callback
+	if(!me->fmt_ctx)
+		me->fmt_ctx = avformat_alloc_context();
+
+	if(!me->fmt_ctx){
+		error = VX_ERR_ALLOCATE;
+		goto cleanup;
+	}
+
+	me->fmt_ctx->interrupt_callback.callback = vx_interrupt_cb;
+	me->fmt_ctx->interrupt_callback.opaque = me;
+
+	if(me->options.probe_size > 0)
+		av_dict_set_int(&format_opts, "probesize", me->options.probe_size, 0);
+
+	if(me->options.analyze_duration > 0)
+		av_dict_set_int(&format_opts, "analyzeduration", me->options.analyze_duration, 0);
+
+	// open stream
+	int err = avformat_open_input(&me->fmt_ctx, filename, NULL, &format_opts);
+	av_dict_free(&format_opts);
+
+	if(err != 0){
+		error = VX_ERR_OPEN_FILE;
+		goto cleanup;
+	}
+
+	int64_t probe_start = av_gettime_relative();
+
+	// Get stream information
+	if(vx_need_stream_info(me) && avformat_find_stream_info(me->fmt_ctx, /*&options*/ NULL) < 0){
+		error = VX_ERR_STREAM_INFO;
+		goto cleanup;
+	}
+
+	vx_thread_stats(me)->probe_us += av_gettime_relative() - probe_start;
+
+	if(me->probe_only)
+		goto done;
+	
+	// find video and audio streams and open respective codecs
+	if(me->options.flags & VX_OF_AUDIO_ONLY){
+		me->video_stream = -1;
+
+		if(!find_stream_and_open_codec(me, AVMEDIA_TYPE_AUDIO, &me->audio_stream, &me->audio_codec_ctx, &error)){
+			// a missing decoder or one that fails to open keeps its own error
+			if(me->audio_stream == AVERROR_STREAM_NOT_FOUND)
+				error = VX_ERR_NO_AUDIO;
+
+			goto cleanup;
+		}
+	}
+
+	else{
+		if(!find_stream_and_open_codec(me, AVMEDIA_TYPE_VIDEO, &me->video_stream, &me->video_codec_ctx, &error)){
+			goto cleanup;
+		}
+
+		// the audio decoder is opened by vx_set_audio_params, until then audio is never read
+		AVCodec* audio_codec;
+
+		if(!find_stream(me, AVMEDIA_TYPE_AUDIO, &me->audio_stream, &audio_codec, &error)){
+			dprintf("no audio stream\n");
+		}
+	}
+
+	vx_update_stream_discard(me);
+
+	if(me->options.flags & VX_OF_KEYFRAMES_ONLY)
+		vx_set_keyframes_only(me, 1);
+
+	// a missing or stale index is not an error, the caller can build a new one
+	if(me->options.index_filename && vx_load_index(me, me->options.index_filename) != VX_ERR_SUCCESS){
+		dprintf("could not load index: %s\n", me->options.index_filename);
+	}
+
+done:
+	vx_thread_stats(me)->open_us += av_gettime_relative() - start;
+	vx_set_deadline(me, 0, false);
+	
+	*video = me;
+	return VX_ERR_SUCCESS;
+
+cleanup:
+	if(vx_interrupted(me) != VX_ERR_SUCCESS)
+		error = vx_interrupted(me);
+
+	vx_close(me);
+	return error;
+}
+
+static vx_error vx_open_custom(vx_video** video, vx_video* me, vx_read_callback read_cb, vx_seek_callback seek_cb,
+	vx_size_callback size_cb, void* user_data);
+static long long vx_mem_seek(void* user_data, long long offset, int whence);
+static long long vx_mem_size(void* user_data);
+static int vx_mem_read(void* user_data, unsigned char* buf, int size);
+
+#ifndef _WIN32
+static int vx_pread_read(void* user_data, unsigned char* buf, int size)
+{
+	vx_video* me = user_data;
+	ssize_t n;
+
+	do{
+		n = pread(me->fd, buf, size, me->mem_pos);
+	} while(n < 0 && errno == EINTR);
+
+	if(n > 0)
+		me->mem_pos += n;
+
+	return (int)n;
+}
+
+// local file through pread or mmap instead of the file protocol, see vx_io_mode
+static vx_error vx_open_file(vx_video** video, vx_video* me, const char* filename)
+{
+	struct stat st;
+
+	me->fd = open(filename, O_RDONLY);
+
+	if(me->fd < 0 || fstat(me->fd, &st) != 0 || st.st_size <= 0){
+		vx_close(me);
+		return VX_ERR_OPEN_FILE;
+	}
+
+	me->mem_size = st.st_size;
+
+	// lets the kernel read further ahead
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise(me->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	if(me->options.io_mode == VX_IO_MMAP){
+		void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, me->fd, 0);
+
+		if(map == MAP_FAILED){
+			vx_close(me);
+			return VX_ERR_OPEN_FILE;
+		}
+
+		posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+		me->mem = map;
+
+		// read like vx_open_mem, AVIO wants its own buffer so the pages are still copied once
+
+		return vx_open_custom(video, me, vx_mem_read, vx_mem_seek, vx_mem_size, me);
+	}
+
+	return vx_open_custom(video, me, vx_pread_read, vx_mem_seek, vx_mem_size, me);
+}
+#endif
+
+static vx_error vx_open_path(vx_video** video, vx_video* me, const char* filename)
+{
+#ifndef _WIN32
+	if(me->options.io_mode == VX_IO_PREAD || me->options.io_mode == VX_IO_MMAP)
+		return vx_open_file(video, me, filename);
+#endif
+
+	return vx_open_input(video, me, filename);
+}
+
+vx_error vx_open_ex(vx_video** video, const char* filename, const vx_open_options* options)
 {
-	if(!me->audio_codec_ctx)
+	vx_video* me = vx_alloc(options);
+
+	if(!me)
+		return VX_ERR_ALLOCATE;
+
+	return vx_open_path(video, me, filename);
+}
+
+static void vx_fill_media_info(vx_video* me, vx_media_info* info)
+{
+	AVFormatContext* fmt_ctx = me->fmt_ctx;
+
+	memset(info, 0, sizeof(vx_media_info));
+
+	info->format_name = fmt_ctx->iformat->name;
+	info->bit_rate = fmt_ctx->bit_rate;
+
+	if(fmt_ctx->duration != AV_NOPTS_VALUE)
+		info->duration = fmt_ctx->duration / (double)AV_TIME_BASE;
+
+	// no decoder needed to pick the streams
+	int video = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+	int audio = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+
+	if(video >= 0){
+		AVStream* st = fmt_ctx->streams[video];
+		AVRational rate = st->avg_frame_rate.num && st->avg_frame_rate.den ? st->avg_frame_rate : st->r_frame_rate;
+		AVRational par = av_guess_sample_aspect_ratio(fmt_ctx, st, NULL);
+
+		info->has_video = 1;
+		info->video_codec = avcodec_get_name(st->codecpar->codec_id);
+		info->width = st->codecpar->width;
+		info->height = st->codecpar->height;
+		info->num_frames = st->nb_frames;
+
+		if(rate.num && rate.den)
+			info->frame_rate = (float)av_q2d(rate);
+
+		if(par.num && par.den)
+			info->pixel_aspect_ratio = (float)av_q2d(par);
+	}
+
+	if(audio >= 0){
+		AVCodecParameters* par = fmt_ctx->streams[audio]->codecpar;
+
+		info->has_audio = 1;
+		info->audio_codec = avcodec_get_name(par->codec_id);
+		info->audio_sample_rate = par->sample_rate;
+		info->audio_channels = par->channels;
+	}
+}
+
+// fills out_info from a container opened with probe_only and closes it again
+static vx_error vx_probe_opened(vx_video* me, vx_error ret, vx_media_info* out_info)
+{
+	if(ret != VX_ERR_SUCCESS)
+		return ret;
+
+	vx_fill_media_info(me, out_info);
+	vx_close(me);
+
+	return VX_ERR_SUCCESS;
+}
+
+vx_error vx_probe(const char* filename, vx_media_info* out_info, const vx_open_options* options)
+{
+	assert(out_info);
+
+	vx_video* me = vx_alloc(options);
+	vx_video* video = NULL;
+
+	if(!me)
+		return VX_ERR_ALLOCATE;
+
+	me->probe_only = true;
+
+	return vx_probe_opened(me, vx_open_path(&video, me, filename), out_info);
+}
+
+static int vx_io_read(void* opaque, uint8_t* buf, int size)
+{
+	vx_video* me = opaque;
+
+	// ffmpeg only checks the interrupt callback for its own protocols
+	if(vx_check_interrupt(me))
+		return AVERROR_EXIT;
+
+	int n = me->io_read(me->io_user_data, buf, size);
+
+	vx_thread_stats(me)->io_reads++;
+
+	if(n > 0)
+		vx_thread_stats(me)->io_bytes_read += n;
+
+	if(n < 0)
+		return AVERROR(EIO);
+
+	return n > 0 ? n : AVERROR_EOF;
+}
+
+static int64_t vx_io_seek(void* opaque, int64_t offset, int whence)
+{
+	vx_video* me = opaque;
+
+	if(whence & AVSEEK_SIZE)
+		return me->io_size ? me->io_size(me->io_user_data) : AVERROR(ENOSYS);
+
+	if(!me->io_seek)
+		return AVERROR(ENOSYS);
+
+	int64_t pos = me->io_seek(me->io_user_data, offset, whence & ~AVSEEK_FORCE);
+
+	vx_thread_stats(me)->io_seeks++;
+
+	return pos >= 0 ? pos : AVERROR(EIO);
+}
+
+static vx_error vx_open_custom(vx_video** video, vx_video* me, vx_read_callback read_cb, vx_seek_callback seek_cb,
+	vx_size_callback size_cb, void* user_data)
+{
+	me->io_read = read_cb;
+	me->io_seek = seek_cb;
+	me->io_size = size_cb;
+	me->io_user_data = user_data;
+
+	int default_size = me->fd >= 0 ? 1024 * 1024 : 64 * 1024;
+	int buffer_size = me->options.io_buffer_size > 0 ? me->options.io_buffer_size : default_size;
+	uint8_t* buffer = av_malloc(buffer_size);
+
+	if(buffer){
+		bool seekable = seek_cb || size_cb;
+		me->avio = avio_alloc_context(buffer, buffer_size, 0, me, vx_io_read, NULL, seekable ? vx_io_seek : NULL);
+	}
+
+	if(!me->avio){
+		av_free(buffer);
+		vx_close(me);
+		return VX_ERR_ALLOCATE;
+	}
+
+	me->fmt_ctx = avformat_alloc_context();
+
+	if(!me->fmt_ctx){
+		vx_close(me);
+		return VX_ERR_ALLOCATE;
+	}
+
+	me->fmt_ctx->pb = me->avio;
+	me->fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+	return vx_open_input(video, me, "");
+}
+
+vx_error vx_open_io(vx_video** video, vx_read_callback read_cb, vx_seek_callback seek_cb, vx_size_callback size_cb,
+	void* user_data, const vx_open_options* options)
+{
+	assert(read_cb);
+
+	vx_video* me = vx_alloc(options);
+
+	if(!me)
+		return VX_ERR_ALLOCATE;
+
+	return vx_open_custom(video, me, read_cb, seek_cb, size_cb, user_data);
+}
+
+vx_error vx_probe_io(vx_read_callback read_cb, vx_seek_callback seek_cb, vx_size_callback size_cb, void* user_data,
+	vx_media_info* out_info, const vx_open_options* options)
+{
+	assert(read_cb);
+	assert(out_info);
+
+	vx_video* me = vx_alloc(options);
+	vx_video* video = NULL;
+
+	if(!me)
+		return VX_ERR_ALLOCATE;
+
+	me->probe_only = true;
+
+	return vx_probe_opened(me, vx_open_custom(&video, me, read_cb, seek_cb, size_cb, user_data), out_info);
+}
+
+static int vx_mem_read(void* user_data, unsigned char* buf, int size)
+{
+	vx_video* me = user_data;
+	int64_t left = me->mem_size - me->mem_pos;
+
+	if(left <= 0)
 		return 0;
 
-	return me->audio_codec_ctx->channels;
+	int n = (int)FFMIN(size, left);
+
+	memcpy(buf, me->mem + me->mem_pos, n);
+	me->mem_pos += n;
+
+	return n;
+}
+
+static long long vx_mem_seek(void* user_data, long long offset, int whence)
+{
+	vx_video* me = user_data;
+	int64_t pos = offset;
+
+	if(whence == SEEK_CUR)
+		pos += me->mem_pos;
+	else if(whence == SEEK_END)
+		pos += me->mem_size;
+
+	if(pos < 0 || pos > me->mem_size)
+		return -1;
+
+	me->mem_pos = pos;
+	return pos;
+}
+
+static long long vx_mem_size(void* user_data)
+{
+	vx_video* me = user_data;
+	return me->mem_size;
+}
+
+vx_error vx_open_mem(vx_video** video, const void* buffer, long long size, const vx_open_options* options)
+{
+	assert(buffer);
+
+	vx_video* me = vx_alloc(options);
+
+	if(!me)
+		return VX_ERR_ALLOCATE;
+
+	me->mem = buffer;
+	me->mem_size = size;
+
+	return vx_open_custom(video, me, vx_mem_read, vx_mem_seek, vx_mem_size, me);
+}
+
+void vx_close(vx_video* me)
+{
+	assert(me);
+
+	vx_async_stop(me);
+	vx_async_free(me);
+
+	if(me->swr_ctx)
+		swr_free(&me->swr_ctx);
+
+	vx_scaler_free(&me->scaler);
+
+	if(me->video_codec_ctx)
+		avcodec_free_context(&me->video_codec_ctx);
+
+	if(me->audio_codec_ctx)
+		avcodec_free_context(&me->audio_codec_ctx);
+
+	if(me->hw_device_ctx)
+		av_buffer_unref(&me->hw_device_ctx);
+
+	if(me->fmt_ctx)
+		avformat_close_input(&me->fmt_ctx);
+
+	// avio may have swapped the buffer for a bigger one
+	if(me->avio){
+		av_freep(&me->avio->buffer);
+		avio_context_free(&me->avio);
+	}
+
+#ifndef _WIN32
+	if(me->fd >= 0){
+		if(me->mem)
+			munmap((void*)me->mem, me->mem_size);
+
+		close(me->fd);
+	}
+#endif
+
+	for(int i = 0; i < me->num_queue; i++){
+		av_frame_free(&me->frame_queue[i].frame);
+
+		if(me->frame_queue[i].scaled)
+			vx_frame_destroy(me->frame_queue[i].scaled);
+	}
+
+	for(int i = 0; i < me->num_frame_pool; i++)
+		av_frame_free(&me->frame_pool[i]);
+
+	free(me->frame_pool);
+
+	av_packet_free(&me->packet);
+
+	free(me->index);
+	free(me->sample_timestamps);
+	av_free(me->audio_ring);
+
+	// closing the input and the avio can still reach the interrupt callback
+	pthread_mutex_destroy(&me->interrupt_lock);
+	free(me);
+}
+
+static bool vx_is_recovery_exhausted(vx_video* me)
+{
+	pthread_mutex_lock(&me->async.lock);
+	bool exhausted = me->recovery_exhausted;
+	pthread_mutex_unlock(&me->async.lock);
+
+	return exhausted;
+}
+
+typedef enum {
+	VX_SYNC_NONE,
+	VX_SYNC_TS,
+	VX_SYNC_MKV_CLUSTER,
+	VX_SYNC_START_CODE
+} vx_sync_type;
+
+// what a resync point looks like in this container, formats with structure that can't be found by
+// scanning (mp4, avi and so on) rely on the index and the demuxer's own resync
+static vx_sync_type vx_get_sync_type(vx_video* me)
+{
+	const char* name = me->fmt_ctx->iformat->name;
+
+	if(strcmp(name, "mpegts") == 0)
+		return VX_SYNC_TS;
+
+	if(strncmp(name, "matroska", 8) == 0)
+		return VX_SYNC_MKV_CLUSTER;
+
+	// raw elementary streams and program streams
+	if(strcmp(name, "mpeg") == 0 || strcmp(name, "mpegvideo") == 0 || strcmp(name, "h264") == 0 ||
+		strcmp(name, "hevc") == 0 || strcmp(name, "m4v") == 0)
+		return VX_SYNC_START_CODE;
+
+	return VX_SYNC_NONE;
+}
+
+// start codes a decoder can restart at: pack and sequence headers, parameter sets and intra pictures
+static bool vx_is_sync_start_code(vx_video* me, uint8_t code)
+{
+	if(code == 0xBA)
+		return true;
+
+	enum AVCodecID codec = me->video_stream >= 0 ? me->fmt_ctx->streams[me->video_stream]->codecpar->codec_id : AV_CODEC_ID_NONE;
+
+	switch(codec){
+		case AV_CODEC_ID_H264:
+			return (code & 0x1F) == 5 || (code & 0x1F) == 7;
+
+		case AV_CODEC_ID_HEVC: {
+			int type = (code >> 1) & 0x3F;
+			return (type >= 16 && type <= 21) || (type >= 32 && type <= 34);
+		}
+
+		case AV_CODEC_ID_MPEG1VIDEO:
+		case AV_CODEC_ID_MPEG2VIDEO:
+			return code == 0xB3 || code == 0xB8;
+
+		case AV_CODEC_ID_MPEG4:
+			return code == 0xB0 || code == 0xB3 || code == 0xB6;
+
+		default:
+			return false;
+	}
+}
+
+// offset of the first sync point in buf that has all of its bytes in buf, or -1
+static int vx_find_sync_point(vx_video* me, vx_sync_type type, const uint8_t* buf, int size)
+{
+	for(int i = 0; i < size; i++){
+		switch(type){
+			case VX_SYNC_TS:
+				// three packets in a row
+				if(i + 2 * 188 < size && buf[i] == 0x47 && buf[i + 188] == 0x47 && buf[i + 2 * 188] == 0x47)
+					return i;
+				break;
+
+			case VX_SYNC_MKV_CLUSTER:
+				if(i + 3 < size && buf[i] == 0x1F && buf[i + 1] == 0x43 && buf[i + 2] == 0xB6 && buf[i + 3] == 0x75)
+					return i;
+				break;
+
+			case VX_SYNC_START_CODE:
+				if(i + 3 < size && buf[i] == 0 && buf[i + 1] == 0 && buf[i + 2] == 1 && vx_is_sync_start_code(me, buf[i + 3]))
+					return i;
+				break;
+
+			default:
+				return -1;
+		}
+	}
+
+	return -1;
+}
+
+// scans [from, from + RESYNC_SCAN_SIZE) for a sync point, -1 if there is none
+static int64_t vx_scan_sync_point(vx_video* me, vx_sync_type type, int64_t from)
+{
+	AVIOContext* pb = me->fmt_ctx->pb;
+	enum { CHUNK = 64 * 1024, OVERLAP = 2 * 188 + 1 };
+
+	if(type == VX_SYNC_NONE || !(pb->seekable & AVIO_SEEKABLE_NORMAL))
+		return -1;
+
+	uint8_t* buf = av_malloc(CHUNK + OVERLAP);
+	int64_t found = -1;
+	int have = 0;
+
+	if(!buf || avio_seek(pb, from, SEEK_SET) < 0)
+		goto cleanup;
+
+	// chunks overlap so a sync point across a chunk boundary is still found
+	for(int64_t pos = from; found < 0 && pos < from + RESYNC_SCAN_SIZE; ){
+		int n = avio_read(pb, buf + have, CHUNK);
+
+		if(n <= 0)
+			break;
+
+		int size = have + n;
+		int offset = vx_find_sync_point(me, type, buf, size);
+
+		if(offset >= 0){
+			found = pos - have + offset;
+			break;
+		}
+
+		have = FFMIN(size, OVERLAP);
+		memmove(buf, buf + size - have, have);
+		pos += n;
+	}
+
+cleanup:
+	av_free(buf);
+	return found;
+}
+
+// First keyframe at or after pos in the libvx index or the demuxer's index, false if there is none.
+// out_ts is in the main stream's time base, both indexes are of that stream.
+static bool vx_find_index_keyframe_after(vx_video* me, int64_t pos, int64_t* out_ts)
+{
+	int64_t found = -1;
+
+	for(int i = 0; i < me->num_index; i++){
+		const vx_index_entry* e = &me->index[i];
+
+		if((e->flags & VX_FF_KEYFRAME) && e->pts != AV_NOPTS_VALUE && e->pos >= pos && (found < 0 || e->pos < found)){
+			found = e->pos;
+			*out_ts = e->pts;
+		}
+	}
+
+	int stream = vx_main_stream(me);
+
+	if(found < 0 && stream >= 0){
+		AVStream* st = me->fmt_ctx->streams[stream];
+
+		// the demuxer's index is only public through these since lavf 58.78, the fields are gone in 5.0
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+		int num_entries = avformat_index_get_entries_count(st);
+#else
+		int num_entries = st->nb_index_entries;
+#endif
+
+		for(int i = 0; i < num_entries; i++){
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(58, 78, 100)
+			const AVIndexEntry* e = avformat_index_get_entry(st, i);
+#else
+			const AVIndexEntry* e = &st->index_entries[i];
+#endif
+
+			if(e && (e->flags & AVINDEX_KEYFRAME) && e->pos >= pos && (found < 0 || e->pos < found)){
+				found = e->pos;
+				*out_ts = e->timestamp;
+			}
+		}
+	}
+
+	return found >= 0;
+}
+
+// Skips past damaged data: to the next indexed keyframe, the next sync point found by scanning, or
+// blindly ahead. Errors close to the last skip double the distance. Returns false once the recovery
+// budget is used up, reading then stops as if the file ended.
+static bool vx_resync(vx_video* me)
+{
+	AVFormatContext* fmt_ctx = me->fmt_ctx;
+	int64_t now = av_gettime_relative();
+	int64_t from = avio_tell(fmt_ctx->pb);
+
+	// a new burst of errors, or more of the same one
+	if(me->resync_last_pos >= 0 && from >= me->resync_last_pos && from - me->resync_last_pos <= 2 * me->resync_skip){
+		me->resync_skip = FFMIN(me->resync_skip * 2, RESYNC_MAX_SKIP);
+	}
+	else{
+		me->resync_skip = RESYNC_MIN_SKIP;
+		me->resync_burst_start = now;
+	}
+
+	from = FFMAX(from, me->resync_last_pos);
+
+	int64_t max_us = me->options.recovery_max_ms * (int64_t)1000;
+	int64_t us = me->recovery_us + now - me->resync_burst_start;
+
+	if((me->options.recovery_max_bytes > 0 && me->recovery_bytes >= me->options.recovery_max_bytes) || (max_us > 0 && us >= max_us)){
+		dprintf("recovery budget used up: %" PRId64 " bytes, %" PRId64 " us\n", me->recovery_bytes, us);
+
+		pthread_mutex_lock(&me->async.lock);
+		me->recovery_exhausted = true;
+		pthread_mutex_unlock(&me->async.lock);
+
+		return false;
+	}
+
+	int64_t target = from + me->resync_skip;
+	int64_t ts = AV_NOPTS_VALUE;
+	bool byte_seek = !(fmt_ctx->iformat->flags & AVFMT_NO_BYTE_SEEK);
+	bool sync_point = true;
+	int ret = -1;
+
+	// index entries are seeked to by timestamp, demuxers like mov can't seek to a byte position
+	if(vx_find_index_keyframe_after(me, target, &ts)){
+		ret = avformat_seek_file(fmt_ctx, vx_main_stream(me), ts, ts, INT64_MAX, 0);
+	}
+
+	if(ret < 0 && byte_seek){
+		int64_t pos = vx_scan_sync_point(me, vx_get_sync_type(me), target);
+
+		if(pos >= 0){
+			ret = avformat_seek_file(fmt_ctx, -1, pos, pos, pos, AVSEEK_FLAG_BYTE);
+		}
+		else{
+			// nothing to aim for, the demuxer resyncs on its own from somewhere after target
+			sync_point = false;
+			ret = avformat_seek_file(fmt_ctx, me->video_stream, target, target + 512, target + 1024 * 1024, AVSEEK_FLAG_BYTE | AVSEEK_FLAG_ANY);
+		}
+	}
+
+	int64_t pos = avio_tell(fmt_ctx->pb);
+	bool moved = ret >= 0 && pos > from;
+
+	dprintf("resync: @%" PRId64 " -> %" PRId64 "%s\n", from, pos, moved ? "" : " (failed)");
+
+	int64_t end = av_gettime_relative();
+
+	// the burst so far counts against the budget, ending it here leaves the next one its start
+	me->recovery_us += end - me->resync_burst_start;
+	vx_thread_stats(me)->recovery_us += end - me->resync_burst_start;
+	me->resync_burst_start = end;
+
+	// a skip that didn't get anywhere leaves the next error in the same burst, which skips further
+	if(!moved){
+		me->resync_last_pos = from;
+		return true;
+	}
+
+	if(sync_point)
+		vx_thread_stats(me)->sync_points++;
+
+	me->recovery_bytes += pos - from;
+	vx_thread_stats(me)->recovery_bytes += pos - from;
+	vx_thread_stats(me)->recovery_seeks++;
+	me->resync_last_pos = pos;
+
+	return true;
+}
+
+static bool vx_read_frame(vx_video* me, AVPacket* packet)
+{
+	AVFormatContext* fmt_ctx = me->fmt_ctx;
+	int64_t start = av_gettime_relative();
+	bool got_packet = false;
+
+	// try to read a frame, if it can't be read, skip ahead and try again
+	for(int i = 0; i < 1024; i++){
+		int ret = av_read_frame(fmt_ctx, packet);
+
+		// success
+		if(ret == 0){
+			vx_thread_stats(me)->packets_read++;
+			got_packet = true;
+			break;
+		}
+
+		// eof, no need to retry
+		if(ret == AVERROR_EOF || avio_feof(fmt_ctx->pb))
+			break;
+
+		vx_thread_stats(me)->read_errors++;
+
+		if(vx_check_interrupt(me))
+			break;
+
+		// other error, might be a damaged stream, the demuxer often resyncs by itself on the next
+		// few reads, otherwise skip ahead
+		if((i % 10) == 0 && !vx_resync(me))
+			break;
+	}
+
+	vx_thread_stats(me)->read_us += av_gettime_relative() - start;
+
+	return got_packet;
+}
+
+vx_error vx_set_count_frames_cb(vx_video* me, vx_on_count_frames_callback cb, void* user_data)
+{
+	assert(me);
+
+	me->count_frames_cb = cb;
+	me->count_frames_user_data = user_data;
+
+	return VX_ERR_SUCCESS;
+}
+
+int vx_get_width(vx_video* me)
+{
+	return me->video_codec_ctx ? me->video_codec_ctx->width : 0;
+}
+
+int vx_get_height(vx_video* me)
+{
+	return me->video_codec_ctx ? me->video_codec_ctx->height : 0;
+}
+
+// timestamps are in this stream's time base, the audio stream when opened with VX_OF_AUDIO_ONLY
+static int vx_main_stream(vx_video* me)
+{
+	return me->video_stream >= 0 ? me->video_stream : me->audio_stream;
+}
+
+long long vx_get_file_position(vx_video* video)
+{
+	return video->fmt_ctx->pb->pos; 
+}
+
+long long vx_get_file_size(vx_video* video)
+{
+	return avio_size(video->fmt_ctx->pb);
+}
+
+// the audio decoder may not be open yet, the stream parameters are known from the start
+static AVCodecParameters* vx_audio_codecpar(vx_video* me)
+{
+	return me->audio_stream >= 0 ? me->fmt_ctx->streams[me->audio_stream]->codecpar : NULL;
+}
+
+int vx_get_audio_sample_rate(vx_video* me)
+{
+	if(!vx_audio_codecpar(me))
+		return 0;
+	
+	return vx_audio_codecpar(me)->sample_rate;
+}
+
+int vx_get_audio_present(vx_video* me)
+{
+	return me->audio_stream >= 0 ? 1 : 0;
+}
+
+int vx_get_audio_channels(vx_video* me)
+{
+	if(!vx_audio_codecpar(me))
+		return 0;
+
+	return vx_audio_codecpar(me)->channels;
+}
+
+const char* vx_get_audio_sample_format_str(vx_video* me)
+{
+	if(!vx_audio_codecpar(me))
+		return NULL;
+
+	return av_get_sample_fmt_name(vx_audio_codecpar(me)->format);
+}
+		
+static AVCodecContext* vx_get_codec_ctx(vx_video* me, int stream)
+{
+	if(stream < 0)
+		return NULL;
+
+	if(stream == me->video_stream)
+		return me->video_codec_ctx;
+
+	if(stream == me->audio_stream)
+		return me->audio_codec_ctx;
+
+	return NULL;
+}
+
+// a pipeline thread counts into its own block, see vx_thread_stats
+static void vx_async_begin_stats(vx_video* me, vx_pipeline_stats* ps)
+{
+	memset(ps, 0, sizeof(vx_pipeline_stats));
+	ps->owner = me;
+
+	pthread_once(&vx_stats_key_once, vx_stats_key_create);
+	pthread_setspecific(vx_stats_key, ps);
+}
+
+// moves a pipeline thread's counters to where vx_get_stats sees them, with the async lock held
+static void vx_async_fold_stats(vx_video* me, vx_pipeline_stats* ps)
+{
+	vx_stats_add(&me->async.stats, &ps->stats);
+	memset(&ps->stats, 0, sizeof(vx_stats));
+}
+
+static void* vx_async_demux_main(void* data)
+{
+	vx_video* me = data;
+	vx_async* a = &me->async;
+	AVPacket* packet = av_packet_alloc();
+
+	vx_pipeline_stats ps;
+	vx_async_begin_stats(me, &ps);
+
+	while(packet){
+		pthread_mutex_lock(&a->lock);
+		bool skip = a->skip_request;
+		a->skip_request = false;
+		pthread_mutex_unlock(&a->lock);
+
+		// with the recovery budget used up the demuxer stops as if the file ended
+		bool got_packet = (!skip || vx_resync(me)) && vx_read_frame(me, packet);
+
+		// packets for streams that aren't decoded are dropped here instead of being queued
+		if(got_packet && !vx_wants_packet(me, packet->stream_index)){
+			vx_thread_stats(me)->packets_discarded++;
+			av_packet_unref(packet);
+			continue;
+		}
+
+		pthread_mutex_lock(&a->lock);
+		vx_async_fold_stats(me, &ps);
+
+		// the last slot is kept for a packet read as the pipeline stops
+		while(got_packet && a->num_packets >= ASYNC_PACKET_QUEUE_SIZE - 1 && !a->abort)
+			pthread_cond_wait(&a->cond, &a->lock);
+
+		if(got_packet && a->abort && a->num_packets < ASYNC_PACKET_QUEUE_SIZE){
+			av_packet_move_ref(a->packets[(a->packet_head + a->num_packets) % ASYNC_PACKET_QUEUE_SIZE], packet);
+			a->num_packets++;
+		}
+
+		if(!got_packet || a->abort){
+			a->demux_eof = true;
+			pthread_cond_broadcast(&a->cond);
+			pthread_mutex_unlock(&a->lock);
+			break;
+		}
+
+		av_packet_move_ref(a->packets[(a->packet_head + a->num_packets) % ASYNC_PACKET_QUEUE_SIZE], packet);
+		a->num_packets++;
+
+		pthread_cond_broadcast(&a->cond);
+		pthread_mutex_unlock(&a->lock);
+	}
+
+	if(packet){
+		av_packet_unref(packet);
+		av_packet_free(&packet);
+	}
+
+	else{
+		// out of memory, let the decode thread finish
+		pthread_mutex_lock(&a->lock);
+		a->demux_eof = true;
+		pthread_cond_broadcast(&a->cond);
+		pthread_mutex_unlock(&a->lock);
+	}
+
+	return NULL;
+}
+
+static bool vx_async_pop_packet(vx_video* me, AVPacket* packet)
+{
+	vx_async* a = &me->async;
+
+	pthread_mutex_lock(&a->lock);
+
+	while(a->num_packets == 0 && !a->demux_eof && !a->abort)
+		pthread_cond_wait(&a->cond, &a->lock);
+
+	bool got_packet = a->num_packets > 0 && !a->abort;
+
+	if(got_packet){
+		av_packet_move_ref(packet, a->packets[a->packet_head]);
+		a->packet_head = (a->packet_head + 1) % ASYNC_PACKET_QUEUE_SIZE;
+		a->num_packets--;
+
+		pthread_cond_broadcast(&a->cond);
+	}
+
+	pthread_mutex_unlock(&a->lock);
+
+	return got_packet;
+}
+
+// false at the end of the file
+static bool vx_next_packet(vx_video* me, AVPacket* packet)
+{
+	if(vx_async_is_running(me))
+		return vx_async_pop_packet(me, packet);
+
+	return vx_read_frame(me, packet);
+}
+
+// why decoding stopped when vx_handle_decode_error gives up
+static vx_error vx_decode_error(vx_video* me)
+{
+	vx_error interrupted = vx_decode_interrupted(me);
+
+	if(interrupted != VX_ERR_SUCCESS)
+		return interrupted;
+
+	return vx_is_recovery_exhausted(me) ? VX_ERR_RECOVERY_BUDGET : VX_ERR_DECODE_VIDEO;
+}
+
+static bool vx_handle_decode_error(vx_video* me, int err, int* retries)
+{
+	char eb[2048];
+	av_strerror(err, eb, sizeof(eb));
+	dprintf("decoding error: %s\n", eb);
+
+	vx_thread_stats(me)->decode_errors++;
+
+	if((*retries)++ > 1000 || vx_is_recovery_exhausted(me) || vx_decode_interrupted(me) != VX_ERR_SUCCESS)
+		return false;
+
+	// every 10 retries, skip ahead a few bytes
+	if((*retries % 10) == 0){
+		// the demux thread owns the format context while the async pipeline is running
+		if(vx_async_is_running(me)){
+			pthread_mutex_lock(&me->async.lock);
+			me->async.skip_request = true;
+			pthread_mutex_unlock(&me->async.lock);
+		}
+
+		else if(!vx_resync(me)){
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// after a seek, frames are dropped until the seek target is reached
+static bool vx_before_seek_target(vx_video* me, int stream_idx, const AVFrame* frame)
+{
+	if(stream_idx == me->video_stream && me->seek_to_keyframe){
+		if(frame->pict_type != AV_PICTURE_TYPE_I)
+			return true;
+
+		me->seek_to_keyframe = false;
+	}
+
+	int64_t pts = frame->best_effort_timestamp;
+
+	if(me->seek_target_pts == AV_NOPTS_VALUE || pts == AV_NOPTS_VALUE)
+		return false;
+
+	if(stream_idx == vx_main_stream(me)){
+		if(pts < me->seek_target_pts)
+			return true;
+
+		me->seek_target_pts = AV_NOPTS_VALUE;
+		return false;
+	}
+
+	// audio until the first video frame at the target
+	return av_compare_ts(pts, me->fmt_ctx->streams[stream_idx]->time_base,
+		me->seek_target_pts, me->fmt_ctx->streams[vx_main_stream(me)]->time_base) < 0;
+}
+
+// whether a decoded video frame is delivered under the current sampling settings
+static bool vx_sample_wanted(vx_video* me, int64_t pts)
+{
+	bool restart = me->sample_restart;
+	me->sample_restart = false;
+
+	switch(me->sample_mode){
+	case VX_SAMPLE_FPS:
+		if(pts == AV_NOPTS_VALUE)
+			return true;
+
+		if(restart)
+			me->sample_next = pts;
+
+		if(pts < me->sample_next)
+			return false;
+
+		// the first sample time after pts, in one step however far pts jumped
+		me->sample_next += ((int64_t)((pts - me->sample_next) / me->sample_interval) + 1) * me->sample_interval;
+
+		return true;
+
+	case VX_SAMPLE_STRIDE:
+		if(restart)
+			me->sample_count = 0;
+
+		return me->sample_count++ % me->sample_stride == 0;
+
+	case VX_SAMPLE_TIMESTAMPS:
+		if(pts == AV_NOPTS_VALUE)
+			return false;
+
+		// after a seek continue with the first timestamp that is still ahead
+		if(restart){
+			me->sample_timestamp_idx = 0;
+
+			while(me->sample_timestamp_idx < me->num_sample_timestamps && me->sample_timestamps[me->sample_timestamp_idx] < pts)
+				me->sample_timestamp_idx++;
+		}
+
+		if(me->sample_timestamp_idx >= me->num_sample_timestamps || pts < me->sample_timestamps[me->sample_timestamp_idx])
+			return false;
+
+		// one frame covers every timestamp up to its own
+		while(me->sample_timestamp_idx < me->num_sample_timestamps && me->sample_timestamps[me->sample_timestamp_idx] <= pts)
+			me->sample_timestamp_idx++;
+
+		return true;
+
+	default:
+		return true;
+	}
+}
+
+// pts of the next frame sampling will deliver, AV_NOPTS_VALUE when it isn't known in advance
+static int64_t vx_sample_next_pts(vx_video* me)
+{
+	if(me->sample_restart)
+		return AV_NOPTS_VALUE;
+
+	if(me->sample_mode == VX_SAMPLE_FPS)
+		return (int64_t)me->sample_next;
+
+	if(me->sample_mode == VX_SAMPLE_TIMESTAMPS && me->sample_timestamp_idx < me->num_sample_timestamps)
+		return me->sample_timestamps[me->sample_timestamp_idx];
+
+	return AV_NOPTS_VALUE;
+}
+
+static bool vx_sample_done(vx_video* me)
+{
+	return me->sample_mode == VX_SAMPLE_TIMESTAMPS && !me->sample_restart && me->sample_timestamp_idx >= me->num_sample_timestamps;
+}
+
+// called for every video packet before it is decoded
+static void vx_sample_packet(vx_video* me, const AVPacket* packet)
+{
+	if((packet->flags & AV_PKT_FLAG_KEY) && packet->pts != AV_NOPTS_VALUE){
+		if(me->last_key_pts != AV_NOPTS_VALUE && packet->pts > me->last_key_pts)
+			me->gop_pts = FFMAX(me->gop_pts, packet->pts - me->last_key_pts);
+
+		me->last_key_pts = packet->pts;
+	}
+
+	// keyframe only mode manages skip_frame itself
+	if(me->sample_mode == VX_SAMPLE_NONE || me->keyframes_only)
+		return;
+
+	// non-reference frames before the next sample can't contribute to it, let the decoder drop them
+	int64_t next = vx_sample_next_pts(me);
+	bool skip = next != AV_NOPTS_VALUE && packet->pts != AV_NOPTS_VALUE && packet->pts < next;
+
+	me->video_codec_ctx->skip_frame = skip ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+}
+
+// seeks to the next sample when it is several GOPs ahead of pts, cheaper than decoding everything in between.
+// Not while the async pipeline owns the demuxer.
+static void vx_sample_seek(vx_video* me, int64_t pts)
+{
+	int64_t next = vx_sample_next_pts(me);
+
+	if(me->async.running || !me->sample_seekable || me->gop_pts <= 0 || next == AV_NOPTS_VALUE || pts == AV_NOPTS_VALUE)
+		return;
+
+	// the audio in the gap would be lost, it is decoded in full instead
+	if(vx_wants_packet(me, me->audio_stream))
+		return;
+
+	if(next - pts <= 2 * me->gop_pts)
+		return;
+
+	if(avformat_seek_file(me->fmt_ctx, me->video_stream, INT64_MIN, next, next, 0) < 0){
+		me->sample_seekable = false;
+		return;
+	}
+
+	// frames already queued stay, everything still inside the decoders is before the next sample
+	avcodec_flush_buffers(me->video_codec_ctx);
+
+	if(me->audio_codec_ctx)
+		avcodec_flush_buffers(me->audio_codec_ctx);
+
+	if(me->swr_ctx)
+		swr_init(me->swr_ctx);
+
+	me->pending_stream = -1;
+	me->flushing = false;
+	me->seek_target_pts = next;
+	me->last_key_pts = AV_NOPTS_VALUE;
+}
+
+static vx_error vx_decode_frame(vx_video* me, vx_frame_info* fi, AVFrame** out_frame, int* out_stream_idx)
+{
+	AVPacket* packet = me->packet;
+	AVFrame* frame = vx_frame_pool_get(me);
+
+	if(!frame)
+		return VX_ERR_ALLOCATE;
+
+	vx_error ret = VX_ERR_UNKNOWN;
+	int64_t file_pos = avio_tell(me->fmt_ctx->pb);
+	int retries = 0;
+	bool got_frame = false;
+	int idle = 0;
+
+	while(!got_frame){
+		// give up (and let the caller retry) when nothing is coming out of the decoders
+		if(idle++ >= 1024)
+			goto cleanup;
+
+		// every requested timestamp has been delivered
+		if(vx_sample_done(me)){
+			ret = VX_ERR_EOF;
+			goto cleanup;
+		}
+
+		// a decoder that was just fed a packet (or flushed) may hold any number of frames,
+		// return all of them before reading the next packet
+		if(me->pending_stream >= 0){
+			int64_t start = av_gettime_relative();
+			int err = avcodec_receive_frame(vx_get_codec_ctx(me, me->pending_stream), frame);
+
+			vx_thread_stats(me)->decode_us += av_gettime_relative() - start;
+
+			if(err == 0)
+				vx_thread_stats(me)->frames_decoded++;
+
+			if(err == 0 && vx_before_seek_target(me, me->pending_stream, frame)){
+				av_frame_unref(frame);
+				idle = 0;
+				continue;
+			}
+
+			// unwanted frames are dropped here, before any transfer or scaling
+			if(err == 0 && me->pending_stream == me->video_stream && !vx_sample_wanted(me, frame->best_effort_timestamp)){
+				int64_t pts = frame->best_effort_timestamp;
+
+				av_frame_unref(frame);
+				vx_sample_seek(me, pts);
+				idle = 0;
+				continue;
+			}
+
+			if(err == 0){
+				*out_stream_idx = me->pending_stream;
+				got_frame = true;
+				break;
+			}
+
+			if(err == AVERROR(EAGAIN) || err == AVERROR_EOF){
+				// decoder is empty, when flushing move on to the audio decoder after the video decoder
+				bool drain_audio = me->flushing && me->pending_stream == me->video_stream && me->audio_codec_ctx;
+				me->pending_stream = drain_audio ? me->audio_stream : -1;
+			}
+
+			else if(!vx_handle_decode_error(me, err, &retries)){
+				ret = vx_decode_error(me);
+				goto cleanup;
+			}
+
+			continue;
+		}
+
+		// all decoders drained after the end of the file, or where recovery gave up
+		if(me->flushing){
+			ret = vx_is_recovery_exhausted(me) ? VX_ERR_RECOVERY_BUDGET : VX_ERR_EOF;
+			goto cleanup;
+		}
+
+		// between packets nothing is lost by stopping, the next call carries on from here
+		vx_error interrupted = vx_decode_interrupted(me);
+
+		if(interrupted != VX_ERR_SUCCESS){
+			ret = interrupted;
+			goto cleanup;
+		}
+
+		if(!vx_next_packet(me, packet)){
+			// the pipeline is being stopped, the packets it read ahead stay queued for the next start
+			if(vx_async_is_aborting(me)){
+				ret = VX_ERR_UNKNOWN;
+				goto cleanup;
+			}
+
+			// a read stopped by vx_cancel rather than the end of the file
+			if(vx_check_interrupt(me)){
+				ret = vx_interrupted(me);
+				goto cleanup;
+			}
+
+			// end of file, signal the decoders to return any frames they are holding on to
+			me->flushing = true;
+			me->pending_stream = me->video_codec_ctx ? me->video_stream : me->audio_stream;
+
+			if(me->video_codec_ctx)
+				avcodec_send_packet(me->video_codec_ctx, NULL);
+
+			if(me->audio_codec_ctx)
+				avcodec_send_packet(me->audio_codec_ctx, NULL);
+
+			continue;
+		}
+
+		// in keyframe only mode non-key video packets are never decoded
+		if(me->keyframes_only && packet->stream_index == me->video_stream && !(packet->flags & AV_PKT_FLAG_KEY)){
+			vx_thread_stats(me)->packets_discarded++;
+			av_packet_unref(packet);
+			continue;
+		}
+
+		if(packet->stream_index == me->video_stream)
+			vx_sample_packet(me, packet);
+
+		AVCodecContext* ctx = vx_wants_packet(me, packet->stream_index) ? vx_get_codec_ctx(me, packet->stream_index) : NULL;
+
+		if(ctx){
+			int64_t start = av_gettime_relative();
+			int err = avcodec_send_packet(ctx, packet);
+
+			vx_thread_stats(me)->decode_us += av_gettime_relative() - start;
+
+			if(err >= 0){
+				me->pending_stream = packet->stream_index;
+			}
+
+			else if(!vx_handle_decode_error(me, err, &retries)){
+				ret = vx_decode_error(me);
+				goto cleanup;
+			}
+		}
+
+		else{
+			vx_thread_stats(me)->packets_discarded++;
+		}
+
+		av_packet_unref(packet);
+	}
+
+	if(!got_frame)
+		goto cleanup;
+
+	if(*out_stream_idx == me->video_stream && frame->format == me->hw_pix_fmt)
+	{
+		AVFrame* sw_frame = vx_frame_pool_get(me);
+	
+		if(!sw_frame){
+			ret = VX_ERR_ALLOCATE;
+			goto cleanup;
+		}
+	
+		int64_t start = av_gettime_relative();
+		bool transferred = av_hwframe_transfer_data(sw_frame, frame, 0) >= 0 && av_frame_copy_props(sw_frame, frame) >= 0;
+
+		vx_thread_stats(me)->hw_transfer_us += av_gettime_relative() - start;
+		vx_thread_stats(me)->hw_transfers++;
+
+		if(!transferred)
+		{
+			dprintf("Error transferring the data to system memory\n");
+			vx_frame_pool_put(me, sw_frame);
+			ret = VX_ERR_DECODE_VIDEO;
+			goto cleanup;
+		}
+		
+		vx_frame_pool_put(me, frame);
+		frame = sw_frame;
+	}
+
+	fi->flags = frame->pict_type == AV_PICTURE_TYPE_I ? VX_FF_KEYFRAME : 0;
+	fi->flags |= frame->pkt_pos < 0 ? VX_FF_BYTE_POS_GUESSED : 0;
+	fi->flags |= frame->pts > 0 ? VX_FF_HAS_PTS : 0; 
+
+	fi->pos = frame->pkt_pos >= 0 ? frame->pkt_pos : file_pos;	
+	fi->pts = frame->best_effort_timestamp;
+	fi->dts = frame->pkt_dts;
+
+	*out_frame = frame;
+
+	return VX_ERR_SUCCESS;
+
+cleanup:
+	if(frame)
+		vx_frame_pool_put(me, frame);
+
+	av_packet_unref(packet);
+
+	return ret;
+}
+
+static vx_error vx_scale_frame(vx_video* me, vx_scaler* scaler, AVFrame* frame, vx_frame* vxframe)
+{
+	vx_error ret = VX_ERR_UNKNOWN;
+	int64_t start = av_gettime_relative();
+
+	vx_thread_stats(me)->scale_calls++;
+
+	int av_pixfmt = vx_to_av_pix_fmt(vxframe->pix_fmt);
+
+	// the decoder already produced what was asked for, copy the planes as they are
+	if(frame->format == av_pixfmt && frame->width == vxframe->width && frame->height == vxframe->height){
+		av_image_copy(vxframe->planes, vxframe->strides, (const uint8_t**)frame->data, frame->linesize,
+			av_pixfmt, frame->width, frame->height);
+
+		vx_thread_stats(me)->scale_us += av_gettime_relative() - start;
+		return VX_ERR_SUCCESS;
+	}
+	
+	struct SwsContext* sws_ctx = vx_scaler_get(scaler,
+		frame->width, frame->height, frame->format, 
+		vxframe->width, vxframe->height, av_pixfmt,
+		vx_to_sws_flags(me->scale_algorithm), me->scale_threads);
+
+	if(!sws_ctx){
+		ret = VX_ERR_SCALING;
+		goto cleanup;
+	}
+
+	assert(frame->data);
+
+	sws_scale(sws_ctx, (const uint8_t* const*)frame->data, frame->linesize, 0, frame->height, vxframe->planes, vxframe->strides); 
+
+	vx_thread_stats(me)->scale_us += av_gettime_relative() - start;
+	return VX_ERR_SUCCESS;
+
+cleanup:
+	vx_thread_stats(me)->scale_us += av_gettime_relative() - start;
+	return ret;
+}
+
+static void vx_async_release_scaled(vx_video* me, vx_frame* scaled)
+{
+	if(!scaled)
+		return;
+
+	vx_async* a = &me->async;
+
+	pthread_mutex_lock(&a->lock);
+
+	// keep it for the decode thread as long as the output format stays the same
+	if(a->num_scaled_pool < a->scaled_pool_capacity && scaled->width == a->width 
+		&& scaled->height == a->height && scaled->pix_fmt == a->pix_fmt)
+	{
+		a->scaled_pool[a->num_scaled_pool++] = scaled;
+		scaled = NULL;
+	}
+
+	pthread_mutex_unlock(&a->lock);
+
+	if(scaled)
+		vx_frame_destroy(scaled);
+}
+
+// conversion stage of the decode thread
+static void vx_async_convert(vx_video* me, vx_async_item* item)
+{
+	vx_async* a = &me->async;
+	vx_frame* scaled = NULL;
+
+	pthread_mutex_lock(&a->lock);
+
+	int width = a->width, height = a->height;
+	vx_pix_fmt pix_fmt = a->pix_fmt;
+
+	if(a->num_scaled_pool > 0)
+		scaled = a->scaled_pool[--a->num_scaled_pool];
+
+	pthread_mutex_unlock(&a->lock);
+
+	if(scaled && (scaled->width != width || scaled->height != height || scaled->pix_fmt != pix_fmt)){
+		vx_frame_destroy(scaled);
+		scaled = NULL;
+	}
+
+	// no output format known yet (or only vx_get_frame_ref is used)
+	if(width <= 0 || height <= 0)
+		goto cleanup;
+
+	if(!scaled && !(scaled = vx_frame_create(width, height, pix_fmt)))
+		goto cleanup;
+
+	if(vx_scale_frame(me, &a->scaler, item->frame, scaled) != VX_ERR_SUCCESS)
+		goto cleanup;
+
+	item->scaled = scaled;
+	return;
+
+cleanup:
+	if(scaled)
+		vx_async_release_scaled(me, scaled);
+}
+
+static void* vx_async_decode_main(void* data)
+{
+	vx_video* me = data;
+	vx_async* a = &me->async;
+
+	vx_pipeline_stats ps;
+	vx_async_begin_stats(me, &ps);
+
+	while(true){
+		vx_async_item item;
+		memset(&item, 0, sizeof(item));
+
+		item.stream_idx = -1;
+		item.error = vx_decode_frame(me, &item.info, &item.frame, &item.stream_idx);
+
+		if(item.error == VX_ERR_SUCCESS && item.stream_idx == me->video_stream)
+			vx_async_convert(me, &item);
+
+		pthread_mutex_lock(&a->lock);
+		vx_async_fold_stats(me, &ps);
+
+		while(a->num_items >= a->item_capacity && !a->abort)
+			pthread_cond_wait(&a->cond, &a->lock);
+
+		bool aborted = a->abort;
+
+		// a frame decoded as the pipeline stops goes into the spare slot, it's already out of the decoders
+		bool keep = !aborted || (item.error == VX_ERR_SUCCESS && a->num_items < a->item_slots);
+
+		if(keep){
+			a->items[(a->item_head + a->num_items) % a->item_slots] = item;
+			a->num_items++;
+			pthread_cond_broadcast(&a->cond);
+		}
+
+		pthread_mutex_unlock(&a->lock);
+
+		if(aborted){
+			if(keep)
+				break;
+
+			if(item.frame)
+				vx_frame_pool_put(me, item.frame);
+
+			vx_async_release_scaled(me, item.scaled);
+			break;
+		}
+
+		// nothing more will come out of the decoders
+		if(item.error == VX_ERR_EOF || item.error == VX_ERR_DECODE_VIDEO || item.error == VX_ERR_RECOVERY_BUDGET ||
+			item.error == VX_ERR_CANCELLED)
+			break;
+	}
+
+	return NULL;
+}
+
+// waits on the async condition (with the lock held), no longer than the deadline of the current call
+static void vx_async_wait_deadline(vx_video* me)
+{
+	pthread_mutex_lock(&me->interrupt_lock);
+	int64_t deadline = me->deadline;
+	pthread_mutex_unlock(&me->interrupt_lock);
+
+	if(deadline <= 0){
+		pthread_cond_wait(&me->async.cond, &me->async.lock);
+		return;
+	}
+
+	// the condition waits on the realtime clock
+	int64_t left = FFMAX(deadline - av_gettime_relative(), 0);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	int64_t nsec = ts.tv_nsec + (left % 1000000) * 1000;
+
+	ts.tv_sec += left / 1000000 + nsec / 1000000000;
+	ts.tv_nsec = nsec % 1000000000;
+
+	pthread_cond_timedwait(&me->async.cond, &me->async.lock, &ts);
+}
+
+static vx_error vx_async_pop(vx_video* me, vx_frame_info* fi, AVFrame** out_frame, int* out_stream_idx, vx_frame** out_scaled)
+{
+	vx_async* a = &me->async;
+
+	if(a->num_taken == 0){
+		vx_error interrupted = VX_ERR_SUCCESS;
+
+		pthread_mutex_lock(&a->lock);
+
+		while(a->num_items == 0 && (interrupted = vx_interrupted(me)) == VX_ERR_SUCCESS)
+			vx_async_wait_deadline(me);
+
+		// nothing was taken, the next call picks up where this one left off
+		if(a->num_items == 0){
+			pthread_mutex_unlock(&a->lock);
+			return interrupted;
+		}
+
+		// as many as the frame queue has room for under one lock, vx_fill_queue takes them all anyway
+		int n = FFMIN(a->num_items, FFMAX(FRAME_QUEUE_SIZE - me->num_queue, 1));
+
+		for(int i = 0; i < n; i++){
+			a->taken[i] = a->items[a->item_head];
+			a->item_head = (a->item_head + 1) % a->item_slots;
+		}
+
+		a->num_items -= n;
+		a->taken_head = 0;
+		a->num_taken = n;
+
+		pthread_cond_broadcast(&a->cond);
+		pthread_mutex_unlock(&a->lock);
+	}
+
+	vx_async_item item = a->taken[a->taken_head++];
+	a->num_taken--;
+
+	if(item.error != VX_ERR_SUCCESS)
+		return item.error;
+
+	*fi = item.info;
+	*out_frame = item.frame;
+	*out_stream_idx = item.stream_idx;
+	*out_scaled = item.scaled;
+
+	return VX_ERR_SUCCESS;
+}
+
+// Starts a demux thread feeding packets to a decode thread, which decodes, converts and queues frames
+// for vx_get_frame. Everything that touches the format context or the decoders from outside these
+// threads (seeking, counting, closing) stops the pipeline first, it's restarted by the next vx_get_frame.
+// A halted pipeline keeps what it read and decoded ahead, so a restart carries on where it stopped.
+static vx_error vx_async_start(vx_video* me)
+{
+	vx_async* a = &me->async;
+
+	if(!a->items){
+		a->item_capacity = me->options.async_frames;
+		a->item_slots = a->item_capacity + 1;
+		a->items = calloc(a->item_slots, sizeof(vx_async_item));
+
+		// every converted frame can be in the async queue, the frame queue or being converted
+		a->scaled_pool_capacity = a->item_slots + FRAME_QUEUE_SIZE + 1;
+		a->scaled_pool = calloc(a->scaled_pool_capacity, sizeof(vx_frame*));
+
+		bool allocated = a->items && a->scaled_pool;
+
+		for(int i = 0; i < ASYNC_PACKET_QUEUE_SIZE; i++){
+			a->packets[i] = av_packet_alloc();
+			allocated = allocated && a->packets[i];
+		}
+
+		if(!allocated){
+			for(int i = 0; i < ASYNC_PACKET_QUEUE_SIZE; i++)
+				av_packet_free(&a->packets[i]);
+
+			free(a->items);
+			free(a->scaled_pool);
+
+			a->items = NULL;
+			a->scaled_pool = NULL;
+			return VX_ERR_ALLOCATE;
+		}
+	}
+
+	a->abort = false;
+	a->demux_eof = false;
+	a->skip_request = false;
+
+	// also read by the pipeline threads, see vx_async_is_running
+	pthread_mutex_lock(&a->lock);
+	a->running = true;
+	pthread_mutex_unlock(&a->lock);
+
+	if(pthread_create(&a->demux_thread, NULL, vx_async_demux_main, me) != 0){
+		pthread_mutex_lock(&a->lock);
+		a->running = false;
+		pthread_mutex_unlock(&a->lock);
+		return VX_ERR_UNKNOWN;
+	}
+
+	if(pthread_create(&a->decode_thread, NULL, vx_async_decode_main, me) != 0){
+		pthread_mutex_lock(&a->lock);
+		a->abort = true;
+		pthread_cond_broadcast(&a->cond);
+		pthread_mutex_unlock(&a->lock);
+
+		pthread_join(a->demux_thread, NULL);
+
+		pthread_mutex_lock(&a->lock);
+		a->running = false;
+		pthread_mutex_unlock(&a->lock);
+		return VX_ERR_UNKNOWN;
+	}
+
+	return VX_ERR_SUCCESS;
+}
+
+// stops the threads, packets and frames already queued are kept for the next vx_async_start.
+// Setters for anything the decode thread reads halt it first, the next frame call restarts it.
+static void vx_async_halt(vx_video* me)
+{
+	vx_async* a = &me->async;
+
+	if(!a->running)
+		return;
+
+	pthread_mutex_lock(&a->lock);
+	a->abort = true;
+	pthread_cond_broadcast(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+
+	pthread_join(a->demux_thread, NULL);
+	pthread_join(a->decode_thread, NULL);
+
+	pthread_mutex_lock(&a->lock);
+	a->running = false;
+	pthread_mutex_unlock(&a->lock);
+}
+
+// drops whatever a halted pipeline read or decoded ahead
+static void vx_async_discard(vx_video* me)
+{
+	vx_async* a = &me->async;
+
+	assert(!a->running);
+
+	for(; a->num_taken > 0; a->num_taken--){
+		vx_async_item* item = &a->taken[a->taken_head++];
+
+		if(item->frame)
+			vx_frame_pool_put(me, item->frame);
+
+		vx_async_release_scaled(me, item->scaled);
+	}
+
+	for(; a->num_packets > 0; a->num_packets--){
+		av_packet_unref(a->packets[a->packet_head]);
+		a->packet_head = (a->packet_head + 1) % ASYNC_PACKET_QUEUE_SIZE;
+	}
+
+	for(; a->num_items > 0; a->num_items--){
+		vx_async_item* item = &a->items[a->item_head];
+
+		if(item->frame)
+			vx_frame_pool_put(me, item->frame);
+
+		vx_async_release_scaled(me, item->scaled);
+		a->item_head = (a->item_head + 1) % a->item_slots;
+	}
+
+	a->taken_head = 0;
+	a->packet_head = 0;
+	a->item_head = 0;
+}
+
+static void vx_async_stop(vx_video* me)
+{
+	vx_async_halt(me);
+	vx_async_discard(me);
+}
+
+static void vx_async_free(vx_video* me)
+{
+	vx_async* a = &me->async;
+
+	for(int i = 0; i < ASYNC_PACKET_QUEUE_SIZE; i++)
+		av_packet_free(&a->packets[i]);
+
+	for(int i = 0; i < a->num_scaled_pool; i++)
+		vx_frame_destroy(a->scaled_pool[i]);
+
+	free(a->scaled_pool);
+	free(a->items);
+	vx_scaler_free(&a->scaler);
+
+	pthread_mutex_destroy(&a->lock);
+	pthread_cond_destroy(&a->cond);
+}
+
+// next decoded frame, from the async pipeline when it's running
+static vx_error vx_produce_frame(vx_video* me, vx_frame_info* fi, AVFrame** out_frame, int* out_stream_idx, vx_frame** out_scaled)
+{
+	*out_scaled = NULL;
+
+	if(me->async.running)
+		return vx_async_pop(me, fi, out_frame, out_stream_idx, out_scaled);
+
+	return vx_decode_frame(me, fi, out_frame, out_stream_idx);
+}
+
+// grows the ring to hold at least num_samples, keeping what is buffered
+static bool vx_audio_ring_reserve(vx_video* me, int num_samples)
+{
+	if(num_samples <= me->audio_ring_capacity)
+		return true;
+
+	int size = me->audio_ring_sample_size;
+	uint8_t* ring = av_malloc((size_t)num_samples * size);
+
+	if(!ring)
+		return false;
+
+	// unwrap into the new buffer
+	for(int i = 0; i < me->audio_ring_count; i++)
+		memcpy(ring + i * size, me->audio_ring + ((me->audio_ring_head + i) % me->audio_ring_capacity) * size, size);
+
+	av_free(me->audio_ring);
+	me->audio_ring = ring;
+	me->audio_ring_capacity = num_samples;
+	me->audio_ring_head = 0;
+
+	return true;
+}
+
+// when the ring is full the oldest samples are dropped, vx_read_audio isn't keeping up
+static void vx_audio_ring_write(vx_video* me, const uint8_t* samples, int num_samples, double ts)
+{
+	int size = me->audio_ring_sample_size;
+	int capacity = me->audio_ring_capacity;
+
+	// more than fits, only the end of it is kept
+	if(num_samples > capacity){
+		int skip = num_samples - capacity;
+
+		vx_thread_stats(me)->audio_samples_dropped += me->audio_ring_count + skip;
+		me->audio_ring_count = 0;
+
+		samples += skip * size;
+		ts += (double)skip / me->out_sample_rate;
+		num_samples = capacity;
+	}
+
+	if(me->audio_ring_count == 0)
+		me->audio_ring_ts = ts;
+
+	int overflow = me->audio_ring_count + num_samples - capacity;
+
+	if(overflow > 0){
+		me->audio_ring_head = (me->audio_ring_head + overflow) % capacity;
+		me->audio_ring_count -= overflow;
+		me->audio_ring_ts += (double)overflow / me->out_sample_rate;
+		vx_thread_stats(me)->audio_samples_dropped += overflow;
+	}
+
+	int tail = (me->audio_ring_head + me->audio_ring_count) % capacity;
+	int first = FFMIN(num_samples, capacity - tail);
+
+	memcpy(me->audio_ring + tail * size, samples, first * size);
+	memcpy(me->audio_ring, samples + first * size, (num_samples - first) * size);
+
+	me->audio_ring_count += num_samples;
+}
+
+static int vx_audio_ring_read(vx_video* me, uint8_t* out, int max_samples)
+{
+	int size = me->audio_ring_sample_size;
+	int n = FFMIN(max_samples, me->audio_ring_count);
+	int first = FFMIN(n, me->audio_ring_capacity - me->audio_ring_head);
+
+	memcpy(out, me->audio_ring + me->audio_ring_head * size, first * size);
+	memcpy(out + first * size, me->audio_ring, (n - first) * size);
+
+	me->audio_ring_head = (me->audio_ring_head + n) % me->audio_ring_capacity;
+	me->audio_ring_count -= n;
+	me->audio_ring_ts += (double)n / me->out_sample_rate;
+
+	return n;
+}
+
+// buffered samples for vx_read_audio, or the running total passed to the audio callback
+static int64_t vx_audio_progress(vx_video* me)
+{
+	return me->audio_cb ? me->audio_samples_delivered : me->audio_ring_count;
+}
+
+// decodes until the frame queue is full, or (when audio_until > 0) until vx_audio_progress reaches audio_until
+static vx_error vx_fill_queue(vx_video* me, int64_t audio_until)
+{
+	vx_error ret = VX_ERR_SUCCESS;
+	AVFrame* frame = NULL;
+
+	while(me->num_queue < FRAME_QUEUE_SIZE && me->decoding_error == VX_ERR_SUCCESS &&
+		(audio_until <= 0 || vx_audio_progress(me) < audio_until))
+	{
+		vx_frame_info fi;
+		vx_frame* scaled = NULL;
+		int stream_idx = -1;
+		ret = vx_produce_frame(me, &fi, &frame, &stream_idx, &scaled);
+
+		// nothing more will come out of the decoders, a timeout is only this call's problem
+		if(ret == VX_ERR_EOF || ret == VX_ERR_DECODE_VIDEO || ret == VX_ERR_RECOVERY_BUDGET || ret == VX_ERR_CANCELLED){
+			if(me->decoding_error == VX_ERR_SUCCESS)
+				me->decoding_error = ret;
+			break;
+		}
+
+		if(ret != VX_ERR_SUCCESS)
+			goto cleanup;
+		
+		if(stream_idx == me->video_stream){
+			// video frame
+
+			vx_frame_queue_item item;
+
+			item.info = fi;
+			item.frame = frame;
+			item.scaled = scaled;
+
+			vx_enqueue(me, item);
+			frame = NULL;
+		}
+
+		else if(stream_idx == me->audio_stream && me->swr_ctx){
+			// audio frame (and audio is enabled)
+
+			int64_t pts = frame->best_effort_timestamp;
+			double ts = pts * av_q2d(me->fmt_ctx->streams[me->audio_stream]->time_base);
+
+			AVCodecContext* actx = me->audio_codec_ctx;
+			int dst_sample_count = av_rescale_rnd(frame->nb_samples, me->out_sample_rate, actx->sample_rate, AV_ROUND_UP);
+
+			if(me->swr_channels != me->audio_codec_ctx->channels || me->swr_channel_layout != me->audio_codec_ctx->channel_layout
+				|| me->swr_sample_rate != me->audio_codec_ctx->sample_rate || me->swr_sample_format != me->audio_codec_ctx->sample_fmt)
+			{
+				dprintf("audio format changed\n");
+				dprintf("channels:       %d -> %d\n", me->swr_channels, me->audio_codec_ctx->channels);
+				dprintf("channel layout: %08"PRIx64" -> %08"PRIx64"\n", me->swr_channel_layout, me->audio_codec_ctx->channel_layout);
+				dprintf("sample rate:    %d -> %d\n", me->swr_sample_rate, me->audio_codec_ctx->sample_rate);
+				dprintf("sample format:  %d -> %d\n", me->swr_sample_format, me->audio_codec_ctx->sample_fmt);
+
+				// reinitialize swr_ctx if the audio codec magically changed parameters
+				if(vx_audio_init_resampler(me) != VX_ERR_SUCCESS){
+					ret = VX_ERR_RESAMPLE_AUDIO;
+					goto cleanup;
+				}
+			}
+
+			int64_t start = av_gettime_relative();
+			int swrret = swr_convert(me->swr_ctx, me->audio_buffer, dst_sample_count, (const uint8_t**)frame->data, frame->nb_samples);
+
+			if(swrret < 0){
+				ret = VX_ERR_RESAMPLE_AUDIO;
+				goto cleanup;
+			}
+
+			// pushed to the callback, or buffered until vx_read_audio
+			if(me->audio_cb){
+				me->audio_cb(me->audio_buffer[0], swrret, ts, me->audio_user_data);
+				me->samples_since_last_frame += swrret;
+				me->audio_samples_delivered += swrret;
+			}
+			else{
+				vx_audio_ring_write(me, me->audio_buffer[0], swrret, ts);
+			}
+
+			vx_thread_stats(me)->audio_us += av_gettime_relative() - start;
+			vx_thread_stats(me)->audio_frames++;
+
+			// defer video frame until later if we've reached max samples (if set)
+			// to allow the application to do additional audio processing 
+			if(me->max_samples > 0 && me->samples_since_last_frame >= me->max_samples)
+			{
+				ret = VX_ERR_FRAME_DEFERRED;
+				me->samples_since_last_frame = 0;
+				vx_thread_stats(me)->frames_deferred++;
+				goto cleanup;
+			}
+		}
+
+		if(frame){
+			vx_frame_pool_put(me, frame);
+			frame = NULL;
+		}
+	}
+
+	return VX_ERR_SUCCESS;
+
+cleanup:
+	if(frame)
+		vx_frame_pool_put(me, frame);
+
+	return ret;
+}
+
+static vx_error vx_get_frame_internal(vx_video* me, vx_frame_queue_item* out_item)
+{
+	vx_error ret = vx_fill_queue(me, 0);
+
+	if(ret != VX_ERR_SUCCESS)
+		return ret;
+
+	if(me->num_queue > 0){
+		*out_item = vx_dequeue(me);
+		return VX_ERR_SUCCESS;
+	}
+
+	return me->decoding_error;
+}
+
+static vx_error vx_start_async_if_enabled(vx_video* me)
+{
+	if(me->options.async_frames > 0 && !me->async.running && me->decoding_error == VX_ERR_SUCCESS)
+		return vx_async_start(me);
+
+	return VX_ERR_SUCCESS;
+}
+
+static vx_error vx_next_frame_timed(vx_video* me, vx_frame_queue_item* out_item)
+{
+	vx_error first_error = VX_ERR_SUCCESS;
+
+	if(!me->video_codec_ctx)
+		return VX_ERR_VIDEO_STREAM;
+
+	vx_error e = vx_start_async_if_enabled(me);
+
+	if(e != VX_ERR_SUCCESS)
+		return e;
+
+	for(int i = 0; i < retry_count; i++)
+	{
+		e = vx_get_frame_internal(me, out_item);
+
+		if(!(e == VX_ERR_UNKNOWN || e == VX_ERR_VIDEO_STREAM || e == VX_ERR_DECODE_VIDEO || 
+			e == VX_ERR_DECODE_AUDIO || e == VX_ERR_NO_AUDIO || e == VX_ERR_RESAMPLE_AUDIO))
+		{
+			return e;
+		}
+		
+		first_error = first_error != VX_ERR_SUCCESS ? first_error : e;
+	}
+
+	return first_error;
+}
+
+// next decoded video frame, the caller owns out_item->frame
+static vx_error vx_next_frame(vx_video* me, vx_frame_queue_item* out_item)
+{
+	vx_error ret = vx_begin_call(me, false);
+
+	if(ret == VX_ERR_SUCCESS)
+		ret = vx_next_frame_timed(me, out_item);
+
+	return vx_end_call(me, ret);
+}
+
+static void vx_set_async_output(vx_video* me, int width, int height, vx_pix_fmt pix_fmt)
+{
+	pthread_mutex_lock(&me->async.lock);
+	me->async.width = width;
+	me->async.height = height;
+	me->async.pix_fmt = pix_fmt;
+	pthread_mutex_unlock(&me->async.lock);
+}
+
+// converts a decoded frame into vxframe, the frame goes back to the pool either way
+static vx_error vx_output_frame(vx_video* me, vx_frame_queue_item* item, vx_frame* vxframe)
+{
+	vx_error ret = VX_ERR_SUCCESS;
+
+	assert(!vxframe->ref);
+
+	vxframe->info = item->info;
+
+	vx_frame* scaled = item->scaled;
+
+	// converted ahead by the decode thread, unless the caller switched formats in the meantime
+	// the caller's buffer may be part of a batch or held on to, it is filled rather than swapped
+	if(scaled && scaled->width == vxframe->width && scaled->height == vxframe->height && scaled->pix_fmt == vxframe->pix_fmt){
+		int64_t start = av_gettime_relative();
+
+		av_image_copy(vxframe->planes, vxframe->strides, (const uint8_t**)scaled->planes, scaled->strides,
+			vx_to_av_pix_fmt(vxframe->pix_fmt), vxframe->width, vxframe->height);
+
+		vx_thread_stats(me)->output_copy_us += av_gettime_relative() - start;
+	}
+
+	else{
+		ret = vx_scale_frame(me, &me->scaler, item->frame, vxframe);
+	}
+
+	vx_async_release_scaled(me, scaled);
+	vx_frame_pool_put(me, item->frame);
+	return ret;
+}
+
+vx_error vx_get_frame(vx_video* me, vx_frame* vxframe)
+{
+	if(me->options.async_frames > 0)
+		vx_set_async_output(me, vxframe->width, vxframe->height, vxframe->pix_fmt);
+
+	vx_frame_queue_item item;
+	vx_error ret = vx_next_frame(me, &item);
+
+	if(ret != VX_ERR_SUCCESS)
+		return ret;
+
+	return vx_output_frame(me, &item, vxframe);
+}
+
+vx_error vx_get_frames(vx_video* me, vx_frame** frames, int max_frames, int* out_num_frames)
+{
+	assert(me);
+
+	*out_num_frames = 0;
+
+	if(max_frames <= 0)
+		return VX_ERR_SUCCESS;
+
+	// converted ahead in the format of the first frame, batches share one
+	if(me->options.async_frames > 0)
+		vx_set_async_output(me, frames[0]->width, frames[0]->height, frames[0]->pix_fmt);
+
+	vx_frame_queue_item items[FRAME_QUEUE_SIZE];
+	int num_frames = 0;
+
+	// the whole batch is one call, frames are taken a queue at a time and then converted together
+	vx_error ret = vx_begin_call(me, false);
+
+	while(ret == VX_ERR_SUCCESS && num_frames < max_frames){
+		int want = FFMIN(max_frames - num_frames, FRAME_QUEUE_SIZE);
+		int n = 0;
+
+		while(n < want && (ret = vx_next_frame_timed(me, &items[n])) == VX_ERR_SUCCESS)
+			n++;
+
+		vx_error converted = VX_ERR_SUCCESS;
+
+		for(int i = 0; i < n; i++){
+			if(converted == VX_ERR_SUCCESS){
+				converted = vx_output_frame(me, &items[i], frames[num_frames]);
+
+				if(converted == VX_ERR_SUCCESS)
+					num_frames++;
+			}
+
+			// the batch stops at the first frame that can't be converted
+			else{
+				vx_async_release_scaled(me, items[i].scaled);
+				vx_frame_pool_put(me, items[i].frame);
+			}
+		}
+
+		if(converted != VX_ERR_SUCCESS)
+			ret = converted;
+	}
+
+	ret = vx_end_call(me, ret);
+
+	*out_num_frames = num_frames;
+
+	// a batch cut short by the end of the file is still a batch, the next call reports the eof
+	if(ret == VX_ERR_EOF && num_frames > 0)
+		return VX_ERR_SUCCESS;
+
+	return ret;
+}
+
+vx_error vx_get_frame_ref(vx_video* me, vx_frame** out_frame)
+{
+	// nothing to convert ahead
+	if(me->options.async_frames > 0)
+		vx_set_async_output(me, 0, 0, VX_PIX_FMT_UNKNOWN);
+
+	vx_frame_queue_item item;
+	vx_error ret = vx_next_frame(me, &item);
+
+	if(ret != VX_ERR_SUCCESS)
+		return ret;
+
+	vx_async_release_scaled(me, item.scaled);
+
+	vx_frame* frame = calloc(1, sizeof(vx_frame));
+
+	if(!frame){
+		vx_frame_pool_put(me, item.frame);
+		return VX_ERR_ALLOCATE;
+	}
+
+	// the frame keeps its reference to the decoder's buffers until vx_frame_destroy
+	frame->info = item.info;
+	frame->ref = item.frame;
+	frame->width = item.frame->width;
+	frame->height = item.frame->height;
+	frame->pix_fmt = vx_from_av_pix_fmt(item.frame->format);
+
+	for(int i = 0; i < 4; i++){
+		frame->planes[i] = item.frame->data[i];
+		frame->strides[i] = item.frame->linesize[i];
+	}
+
+	*out_frame = frame;
+	return VX_ERR_SUCCESS;
+}
+
+static void vx_reset_decoding(vx_video* me)
+{
+	// whatever the pipeline read or decoded ahead is stale now
+	vx_async_discard(me);
+
+	if(me->video_codec_ctx)
+		avcodec_flush_buffers(me->video_codec_ctx);
+
+	if(me->audio_codec_ctx)
+		avcodec_flush_buffers(me->audio_codec_ctx);
+
+	// drop any samples the resampler is holding on to from before the seek
+	if(me->swr_ctx)
+		swr_init(me->swr_ctx);
+
+	while(me->num_queue > 0){
+		vx_frame_queue_item item = vx_dequeue(me);
+		vx_frame_pool_put(me, item.frame);
+		vx_async_release_scaled(me, item.scaled);
+	}
+
+	me->pending_stream = -1;
+	me->flushing = false;
+	me->decoding_error = VX_ERR_SUCCESS;
+	me->audio_ring_count = 0;
+
+	// the next error starts a new burst, the budget spent so far stays spent
+	me->resync_last_pos = -1;
+	me->samples_since_last_frame = 0;
+	me->seek_target_pts = AV_NOPTS_VALUE;
+	me->seek_to_keyframe = false;
+	me->sample_restart = true;
+	me->last_key_pts = AV_NOPTS_VALUE;
+}
+
+// last indexed keyframe at or before ts
+static const vx_index_entry* vx_find_index_keyframe(vx_video* me, int64_t ts)
+{
+	const vx_index_entry* found = NULL;
+
+	for(int i = 0; i < me->num_index; i++){
+		const vx_index_entry* e = &me->index[i];
+
+		if((e->flags & VX_FF_KEYFRAME) && e->pts != AV_NOPTS_VALUE && e->pts <= ts && e->pos >= 0)
+			found = e;
+	}
+
+	return found;
+}
+
+static vx_error vx_seek_timed(vx_video* me, long long ts, int flags)
+{
+	// on failure the read ahead is still good, vx_reset_decoding drops it once the seek went through
+	vx_async_halt(me);
+
+	// closest keyframe at or before ts
+	if(avformat_seek_file(me->fmt_ctx, vx_main_stream(me), INT64_MIN, ts, ts, 0) < 0){
+		// demuxers that can't seek by timestamp can often still seek to a byte position from the index
+		const vx_index_entry* keyframe = vx_find_index_keyframe(me, ts);
+
+		if(!keyframe || avformat_seek_file(me->fmt_ctx, -1, keyframe->pos, keyframe->pos, keyframe->pos, AVSEEK_FLAG_BYTE) < 0)
+			return VX_ERR_SEEK;
+	}
+
+	vx_reset_decoding(me);
+
+	if(flags & VX_SEEK_EXACT)
+		me->seek_target_pts = ts;
+
+	return VX_ERR_SUCCESS;
 }
 
-const char* vx_get_audio_sample_format_str(vx_video* me)
+vx_error vx_seek(vx_video* me, long long ts, int flags)
 {
-	if(!me->audio_codec_ctx)
-		return NULL;
+	assert(me);
 
-	return av_get_sample_fmt_name(me->audio_codec_ctx->sample_fmt);
+	vx_error ret = vx_begin_call(me, true);
+
+	if(ret == VX_ERR_SUCCESS)
+		ret = vx_seek_timed(me, ts, flags);
+
+	return vx_end_call(me, ret);
 }
-		
-static vx_error vx_decode_frame(vx_video* me, vx_frame_info* fi, AVFrame** out_frame, int* out_stream_idx)
+
+static vx_error vx_seek_byte_timed(vx_video* me, long long pos, int flags)
 {
-	AVPacket packet;
-	memset(&packet, 0, sizeof(packet));
+	vx_async_halt(me);
 
-	int frame_finished = 0;
-	AVFrame* frame = av_frame_alloc();
+	if(avformat_seek_file(me->fmt_ctx, -1, pos, pos, INT64_MAX, AVSEEK_FLAG_BYTE) < 0)
+		return VX_ERR_SEEK;
 
-	vx_error ret = VX_ERR_UNKNOWN;
-	int64_t frame_pos = -1;
-	int64_t file_pos = avio_tell(me->fmt_ctx->pb);
-	int retries = 0;
+	vx_reset_decoding(me);
 
-	for(int i = 0; i < 1024; i++){
-		if(!vx_read_frame(me->fmt_ctx, &packet, me->video_stream)){
-			ret = VX_ERR_EOF;
-			goto cleanup;
-		}
+	// the demuxer resyncs at an arbitrary packet, skip ahead to a clean picture unless asked not to
+	if(!(flags & VX_SEEK_EXACT))
+		me->seek_to_keyframe = true;
 
-		*out_stream_idx = packet.stream_index;
+	return VX_ERR_SUCCESS;
+}
 
-		if(packet.stream_index == me->video_stream || packet.stream_index == me->audio_stream){
-			int bytes_remaining = packet.size;
-			int bytes_decoded = 0;
+vx_error vx_seek_byte(vx_video* me, long long pos, int flags)
+{
+	assert(me);
 
-			if(frame_pos < 0 && packet.pos != -1)
-				frame_pos = packet.pos;
+	vx_error ret = vx_begin_call(me, true);
 
-			// Decode until all bytes in the packet are decoded
-			while(bytes_remaining > 0 && !frame_finished){
-				if(packet.stream_index == me->video_stream){
-					bytes_decoded = avcodec_decode_video2(me->video_codec_ctx, frame, &frame_finished, &packet);
-				}else{
-					bytes_decoded = avcodec_decode_audio4(me->audio_codec_ctx, frame, &frame_finished, &packet);
-				}
+	if(ret == VX_ERR_SUCCESS)
+		ret = vx_seek_byte_timed(me, pos, flags);
 
-				char eb[2048];
+	return vx_end_call(me, ret);
+}
 
-				if(bytes_decoded < 0){
-					av_strerror(bytes_decoded, eb, sizeof(eb));
+static vx_error vx_rewind(vx_video* me)
+{
+	vx_async_stop(me);
 
-					if(retries++ > 1000){
-						ret = VX_ERR_DECODE_VIDEO;
-						goto cleanup;
-					}
+	int64_t start = me->fmt_ctx->start_time != AV_NOPTS_VALUE ? me->fmt_ctx->start_time : 0;
 
-					// every 10 retries, skip ahead a few bytes
-					if((retries % 10) == 0){
-						int64_t fp = avio_tell(me->fmt_ctx->pb);
-						avformat_seek_file(me->fmt_ctx, me->video_stream, fp + 100, fp + 512, fp + 1024 * 1024, AVSEEK_FLAG_BYTE | AVSEEK_FLAG_ANY);
-					}
+	if(av_seek_frame(me->fmt_ctx, -1, start, AVSEEK_FLAG_BACKWARD) < 0 
+		&& avformat_seek_file(me->fmt_ctx, -1, 0, 0, 0, AVSEEK_FLAG_BYTE) < 0)
+	{
+		return VX_ERR_SEEK;
+	}
 
-					break;
-				}
+	vx_reset_decoding(me);
 
-				bytes_remaining -= bytes_decoded;
-			}
-		}
+	// a pass over the whole file (counting, indexing) starts with a fresh recovery budget
+	me->recovery_bytes = 0;
+	me->recovery_us = 0;
+	me->resync_skip = RESYNC_MIN_SKIP;
 
-		av_free_packet(&packet);
+	pthread_mutex_lock(&me->async.lock);
+	me->recovery_exhausted = false;
+	pthread_mutex_unlock(&me->async.lock);
 
-		if(frame_finished)
-			break;
+	return VX_ERR_SUCCESS;
+}
+
+static bool vx_index_add(vx_video* me, const vx_index_entry* entry)
+{
+	if(me->num_index == me->index_capacity){
+		int capacity = me->index_capacity > 0 ? me->index_capacity * 2 : 1024;
+		vx_index_entry* index = realloc(me->index, capacity * sizeof(vx_index_entry));
+
+		if(!index)
+			return false;
+
+		me->index = index;
+		me->index_capacity = capacity;
 	}
 
-	if(frame->format == me->hw_pix_fmt)
-	{
-		AVFrame* sw_frame = av_frame_alloc();
-	
-		if(!sw_frame)
-			goto cleanup;
-	
-		if((ret = av_hwframe_transfer_data(sw_frame, frame, 0)) < 0)
-		{
-			dprintf("Error transferring the data to system memory\n");
-			goto cleanup;
-		}
-		
-		av_frame_unref(frame);
-		av_frame_free(&frame);
+	me->index[me->num_index++] = *entry;
+	return true;
+}
 
-		frame = sw_frame;
+static void vx_index_clear(vx_video* me)
+{
+	free(me->index);
+
+	me->index = NULL;
+	me->num_index = 0;
+	me->index_capacity = 0;
+}
+
+// mp4/mov store a sample table with an entry for every frame, other containers' counts are estimates (if present at all)
+static bool vx_container_frame_count_reliable(vx_video* me)
+{
+	return strncmp(me->fmt_ctx->iformat->name, "mov", 3) == 0 && me->fmt_ctx->streams[me->video_stream]->nb_frames > 0;
+}
+
+// Reads the file from the start and counts its video packets. Only video is read unless there is a
+// count callback, which is called for the packets of every stream.
+static vx_error vx_count_video_packets(vx_video* me, int* out_num_frames)
+{
+	int num_frames = 0;
+	unsigned nb_streams = me->fmt_ctx->nb_streams;
+	enum AVDiscard* discard = malloc(nb_streams * sizeof(enum AVDiscard));
+
+	if(!discard)
+		return VX_ERR_ALLOCATE;
+
+	vx_error ret = vx_rewind(me);
+
+	if(ret != VX_ERR_SUCCESS){
+		free(discard);
+		return ret;
 	}
 
-	fi->flags = frame->pict_type == AV_PICTURE_TYPE_I ? VX_FF_KEYFRAME : 0;
-	fi->flags |= frame_pos < 0 ? VX_FF_BYTE_POS_GUESSED : 0;
-	fi->flags |= frame->pts > 0 ? VX_FF_HAS_PTS : 0; 
+	for(unsigned i = 0; i < nb_streams; i++){
+		discard[i] = me->fmt_ctx->streams[i]->discard;
 
-	fi->pos = frame_pos >= 0 ? frame_pos : file_pos;	
-	fi->pts = frame->best_effort_timestamp;
-	fi->dts = frame->pkt_dts;
+		if(me->count_frames_cb)
+			me->fmt_ctx->streams[i]->discard = AVDISCARD_DEFAULT;
+		else if((int)i != me->video_stream)
+			me->fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+	}
 
-	*out_frame = frame;
+	AVPacket* packet = me->packet;
 
-	return VX_ERR_SUCCESS;
+	while(vx_read_frame(me, packet)){
+		if(packet->stream_index == me->video_stream)
+			num_frames++;
 
-cleanup:
-	if(frame){
-		av_frame_unref(frame);
-		av_frame_free(&frame);
+		if(me->count_frames_cb)
+			me->count_frames_cb(packet->stream_index, me->count_frames_user_data);
+
+		av_packet_unref(packet);
 	}
 
-	if(packet.data)
-		av_free_packet(&packet);
+	for(unsigned i = 0; i < nb_streams; i++)
+		me->fmt_ctx->streams[i]->discard = discard[i];
 
-	return ret;
+	free(discard);
+
+	*out_num_frames = num_frames;
+	return VX_ERR_SUCCESS;
 }
 
-static vx_error vx_scale_frame(vx_video* me, AVFrame* frame, vx_frame* vxframe)
+static vx_error vx_count_frames_timed(vx_video* me, int* out_num_frames, vx_count_method* out_method)
 {
-	vx_error ret = VX_ERR_UNKNOWN;
+	if(!me->video_codec_ctx)
+		return VX_ERR_VIDEO_STREAM;
 
-	int av_pixfmt = vx_to_av_pix_fmt(vxframe->pix_fmt);
-	
-	struct SwsContext* sws_ctx = sws_getContext(
-		frame->width, frame->height, frame->format, 
-		vxframe->width, vxframe->height, av_pixfmt,
-		SWS_FAST_BILINEAR, NULL, NULL, NULL);
+	vx_count_method method;
+	vx_error ret = VX_ERR_SUCCESS;
 
-	if(!sws_ctx){
-		ret = VX_ERR_SCALING;
-		goto cleanup;
+	// the callback wants to see every packet, which only the demuxer can give it
+	if(me->index && !me->count_frames_cb){
+		// the index has one entry per video packet
+		method = VX_COUNT_INDEX;
+		*out_num_frames = me->num_index;
 	}
 
-	assert(frame->data);
+	else if(vx_container_frame_count_reliable(me) && !me->count_frames_cb){
+		method = VX_COUNT_CONTAINER;
+		*out_num_frames = (int)me->fmt_ctx->streams[me->video_stream]->nb_frames;
+	}
 
-	int fmtBytesPerPixel[3] = {3, 1, 4};
+	else{
+		method = VX_COUNT_DEMUX;
+		ret = vx_count_video_packets(me, out_num_frames);
 
-	uint8_t* pixels[3] = { vxframe->buffer, 0, 0 };
-	int pitch[3] = {fmtBytesPerPixel[vxframe->pix_fmt] * vxframe->width, 0, 0};
+		// a count cut short is no count, the rewind gets to run without the deadline
+		vx_error interrupted = vx_interrupted(me);
+		vx_set_deadline(me, 0, false);
 
-	sws_scale(sws_ctx, (const uint8_t* const*)frame->data, frame->linesize, 0, frame->height, pixels, pitch); 
+		// go back to the start so frames can be read right away
+		vx_error rewound = vx_rewind(me);
 
-	sws_freeContext(sws_ctx);
-	
-	return VX_ERR_SUCCESS;
+		if(interrupted != VX_ERR_SUCCESS)
+			return interrupted;
+
+		if(ret == VX_ERR_SUCCESS)
+			ret = rewound;
+	}
+
+	if(out_method)
+		*out_method = method;
 
-cleanup:
 	return ret;
 }
 
-vx_error vx_get_frame_internal(vx_video* me, vx_frame* vxframe)
+vx_error vx_count_frames_ex(vx_video* me, int* out_num_frames, vx_count_method* out_method)
 {
-	vx_error ret = VX_ERR_UNKNOWN;
-	AVFrame* frame = NULL;
+	assert(me);
 
-	while(me->num_queue < FRAME_QUEUE_SIZE && me->decoding_error == VX_ERR_SUCCESS){
-		vx_frame_info fi;
-		int stream_idx = -1;
-		ret = vx_decode_frame(me, &fi, &frame, &stream_idx);
+	vx_error ret = vx_begin_call(me, true);
 
-		if(ret == VX_ERR_EOF || ret == VX_ERR_DECODE_VIDEO){
-			if(me->decoding_error == VX_ERR_SUCCESS)
-				me->decoding_error = ret;
-			break;
-		}
+	if(ret == VX_ERR_SUCCESS)
+		ret = vx_count_frames_timed(me, out_num_frames, out_method);
 
-		if(ret != VX_ERR_SUCCESS)
-			goto cleanup;
-		
-		if(stream_idx == me->video_stream){
-			// video frame
+	return vx_end_call(me, ret);
+}
 
-			vx_frame_queue_item item;
+vx_error vx_count_frames(vx_video* me, int* out_num_frames)
+{
+	return vx_count_frames_ex(me, out_num_frames, NULL);
+}
 
-			item.info = fi;
-			item.frame = frame;
+static vx_error vx_build_index_timed(vx_video* me)
+{
+	if(!me->video_codec_ctx)
+		return VX_ERR_VIDEO_STREAM;
 
-			vx_enqueue(me, item);
-		}
+	vx_error ret = vx_rewind(me);
 
-		else if(stream_idx == me->audio_stream && me->audio_cb){
-			// audio frame (and audio is enabled)
+	if(ret != VX_ERR_SUCCESS)
+		return ret;
 
-			int64_t pts = av_frame_get_best_effort_timestamp(frame);
-			double ts = pts * av_q2d(me->fmt_ctx->streams[me->audio_stream]->time_base);
+	vx_index_clear(me);
 
-			AVCodecContext* actx = me->audio_codec_ctx;
-			int dst_sample_count = av_rescale_rnd(frame->nb_samples, me->out_sample_rate, actx->sample_rate, AV_ROUND_UP);
+	AVPacket* packet = me->packet;
 
-			if(me->swr_channels != me->audio_codec_ctx->channels || me->swr_channel_layout != me->audio_codec_ctx->channel_layout
-				|| me->swr_sample_rate != me->audio_codec_ctx->sample_rate || me->swr_sample_format != me->audio_codec_ctx->sample_fmt)
-			{
-				dprintf("audio format changed\n");
-				dprintf("channels:       %d -> %d\n", me->swr_channels, me->audio_codec_ctx->channels);
-				dprintf("channel layout: %08"PRIx64" -> %08"PRIx64"\n", me->swr_channel_layout, me->audio_codec_ctx->channel_layout);
-				dprintf("sample rate:    %d -> %d\n", me->swr_sample_rate, me->audio_codec_ctx->sample_rate);
-				dprintf("sample format:  %d -> %d\n", me->swr_sample_format, me->audio_codec_ctx->sample_fmt);
+	while(vx_read_frame(me, packet)){
+		if(packet->stream_index == me->video_stream){
+			vx_index_entry entry;
 
-				// reinitialize swr_ctx if the audio codec magically changed parameters
-				vx_set_audio_params(me, me->out_sample_rate, me->out_channels, me->out_sample_format, me->audio_cb, me->audio_user_data);
+			entry.pts = packet->pts;
+			entry.dts = packet->dts;
+			entry.pos = packet->pos;
+			entry.size = packet->size;
+			entry.flags = packet->flags & AV_PKT_FLAG_KEY ? VX_FF_KEYFRAME : 0;
+
+			if(!vx_index_add(me, &entry)){
+				av_packet_unref(packet);
+				vx_index_clear(me);
+				return VX_ERR_ALLOCATE;
 			}
+		}
 
-			int swrret = swr_convert(me->swr_ctx, me->audio_buffer, dst_sample_count, (const uint8_t**)frame->data, frame->nb_samples);
+		av_packet_unref(packet);
+	}
 
-			if(swrret < 0){
-				ret = VX_ERR_RESAMPLE_AUDIO;
-				goto cleanup;
-			}
+	// an index cut short would be taken for a complete one
+	vx_error interrupted = vx_interrupted(me);
 
-			me->audio_cb(me->audio_buffer[0], swrret, ts, me->audio_user_data);
-			me->samples_since_last_frame += swrret;
+	if(interrupted != VX_ERR_SUCCESS){
+		vx_index_clear(me);
+		vx_set_deadline(me, 0, false);
+		vx_rewind(me);
+		return interrupted;
+	}
 
-			// defer video frame until later if we've reached max samples (if set)
-			// to allow the application to do additional audio processing 
-			if(me->max_samples > 0 && me->samples_since_last_frame >= me->max_samples)
-			{
-				ret = VX_ERR_FRAME_DEFERRED;
-				me->samples_since_last_frame = 0;
-				goto cleanup;
-			}
-		}
+	// the packets past the damage that used up the recovery budget are missing, the index is not exact
+	if(vx_is_recovery_exhausted(me)){
+		vx_index_clear(me);
+		vx_rewind(me);
+		return VX_ERR_INDEX;
 	}
 
-	if(me->num_queue > 0){
-		vx_frame_queue_item item = vx_dequeue(me);
+	return vx_rewind(me);
+}
 
-		frame = item.frame;
-		vxframe->info = item.info;
+vx_error vx_build_index(vx_video* me)
+{
+	assert(me);
 
-		ret = vx_scale_frame(me, frame, vxframe);
-		if(ret != VX_ERR_SUCCESS)
-			goto cleanup;
+	vx_error ret = vx_begin_call(me, true);
 
-		av_frame_unref(frame);
-		av_frame_free(&frame);
-	}
+	if(ret == VX_ERR_SUCCESS)
+		ret = vx_build_index_timed(me);
 
-	else{
-		return me->decoding_error;
+	return vx_end_call(me, ret);
+}
+
+const vx_index_entry* vx_get_index(vx_video* me, int* out_num_entries)
+{
+	assert(me);
+
+	*out_num_entries = me->num_index;
+	return me->index;
+}
+
+// index files are little endian: magic, file size, fingerprint, entry count, entries
+static const char vx_index_magic[8] = {'V', 'X', 'I', 'D', 'X', '0', '0', '2'};
+
+#define VX_FINGERPRINT_BYTES (64 * 1024)
+
+// FNV-1a over the first and last 64 KiB of the input, which catches files of the same size
+// without reading them in full. The input is put back where the demuxer left it.
+static bool vx_file_fingerprint(vx_video* me, int64_t* out_size, uint64_t* out_hash)
+{
+	AVIOContext* pb = me->fmt_ctx->pb;
+	int64_t size = avio_size(pb);
+	int64_t pos = avio_tell(pb);
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	bool ok = false;
+
+	if(size < 0 || pos < 0 || !(pb->seekable & AVIO_SEEKABLE_NORMAL))
+		return false;
+
+	uint8_t* buffer = av_malloc(VX_FINGERPRINT_BYTES);
+
+	if(!buffer)
+		return false;
+
+	int64_t offsets[2] = {0, FFMAX(size - VX_FINGERPRINT_BYTES, 0)};
+
+	for(int i = 0; i < 2; i++){
+		int n = (int)FFMIN(size - offsets[i], VX_FINGERPRINT_BYTES);
+
+		if(avio_seek(pb, offsets[i], SEEK_SET) < 0 || (n > 0 && avio_read(pb, buffer, n) != n))
+			goto cleanup;
+
+		for(int j = 0; j < n; j++){
+			hash ^= buffer[j];
+			hash *= 0x100000001b3ULL;
+		}
 	}
 
-	return VX_ERR_SUCCESS;
+	ok = true;
 
 cleanup:
-	if(frame){
-		av_frame_unref(frame);
-		av_frame_free(&frame);
+	av_free(buffer);
+
+	if(avio_seek(pb, pos, SEEK_SET) < 0)
+		return false;
+
+	*out_size = size;
+	*out_hash = hash;
+	return ok;
+}
+
+static void vx_write_le(FILE* f, int64_t v, int bytes)
+{
+	uint8_t b[8];
+
+	for(int i = 0; i < bytes; i++)
+		b[i] = (uint8_t)((uint64_t)v >> (i * 8));
+
+	fwrite(b, bytes, 1, f);
+}
+
+static bool vx_read_le(FILE* f, int64_t* out_v, int bytes)
+{
+	uint8_t b[8];
+	uint64_t v = 0;
+
+	if(fread(b, bytes, 1, f) != 1)
+		return false;
+
+	for(int i = 0; i < bytes; i++)
+		v |= (uint64_t)b[i] << (i * 8);
+
+	// sign extend 32 bit values
+	if(bytes == 4)
+		v = (uint64_t)(int64_t)(int32_t)(uint32_t)v;
+
+	*out_v = (int64_t)v;
+	return true;
+}
+
+vx_error vx_save_index(vx_video* me, const char* filename)
+{
+	assert(me);
+
+	if(!me->index)
+		return VX_ERR_INDEX;
+
+	// the fingerprint reads the input, which the demux thread is reading from
+	vx_async_halt(me);
+
+	int64_t file_size;
+	uint64_t hash;
+
+	if(!vx_file_fingerprint(me, &file_size, &hash))
+		return VX_ERR_INDEX;
+
+	FILE* f = fopen(filename, "wb");
+
+	if(!f)
+		return VX_ERR_OPEN_FILE;
+
+	fwrite(vx_index_magic, sizeof(vx_index_magic), 1, f);
+	vx_write_le(f, file_size, 8);
+	vx_write_le(f, (int64_t)hash, 8);
+	vx_write_le(f, me->num_index, 8);
+
+	for(int i = 0; i < me->num_index; i++){
+		const vx_index_entry* e = &me->index[i];
+
+		vx_write_le(f, e->pts, 8);
+		vx_write_le(f, e->dts, 8);
+		vx_write_le(f, e->pos, 8);
+		vx_write_le(f, e->size, 4);
+		vx_write_le(f, e->flags, 4);
 	}
 
-	return ret;
+	bool ok = !ferror(f);
+
+	if(fclose(f) != 0 || !ok)
+		return VX_ERR_INDEX;
+
+	return VX_ERR_SUCCESS;
 }
 
-vx_error vx_get_frame(vx_video* me, vx_frame* vxframe)
+vx_error vx_load_index(vx_video* me, const char* filename)
 {
-	vx_error first_error = VX_ERR_SUCCESS;
+	assert(me);
 
-	for(int i = 0; i < retry_count; i++)
+	// the demux thread looks up the index and the input when it resyncs
+	vx_async_halt(me);
+
+	FILE* f = fopen(filename, "rb");
+
+	if(!f)
+		return VX_ERR_OPEN_FILE;
+
+	vx_error ret = VX_ERR_INDEX;
+	char magic[sizeof(vx_index_magic)];
+	int64_t file_size, hash, num_entries;
+	int64_t expected_size;
+	uint64_t expected_hash;
+
+	vx_index_clear(me);
+
+	if(fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, vx_index_magic, sizeof(magic)) != 0)
+		goto cleanup;
+
+	// an index for a different (or modified) file is worse than none
+	if(!vx_file_fingerprint(me, &expected_size, &expected_hash))
+		goto cleanup;
+
+	if(!vx_read_le(f, &file_size, 8) || !vx_read_le(f, &hash, 8)
+		|| file_size != expected_size || (uint64_t)hash != expected_hash)
 	{
-		vx_error e = vx_get_frame_internal(me, vxframe);
+		goto cleanup;
+	}
 
-		if(!(e == VX_ERR_UNKNOWN || e == VX_ERR_VIDEO_STREAM || e == VX_ERR_DECODE_VIDEO || 
-			e == VX_ERR_DECODE_AUDIO || e == VX_ERR_NO_AUDIO || e == VX_ERR_RESAMPLE_AUDIO))
+	if(!vx_read_le(f, &num_entries, 8) || num_entries < 0 || num_entries > INT_MAX)
+		goto cleanup;
+
+	for(int64_t i = 0; i < num_entries; i++){
+		vx_index_entry e;
+		int64_t pts, dts, pos, size, flags;
+
+		if(!vx_read_le(f, &pts, 8) || !vx_read_le(f, &dts, 8) || !vx_read_le(f, &pos, 8)
+			|| !vx_read_le(f, &size, 4) || !vx_read_le(f, &flags, 4))
 		{
-			return e;
+			goto cleanup;
+		}
+
+		e.pts = pts;
+		e.dts = dts;
+		e.pos = pos;
+		e.size = (int)size;
+		e.flags = (int)flags;
+
+		if(!vx_index_add(me, &e)){
+			ret = VX_ERR_ALLOCATE;
+			goto cleanup;
 		}
-		
-		first_error = first_error != VX_ERR_SUCCESS ? first_error : e;
 	}
 
-	return first_error;
+	fclose(f);
+	return VX_ERR_SUCCESS;
+
+cleanup:
+	vx_index_clear(me);
+	fclose(f);
+	return ret;
 }
 
 vx_error vx_get_frame_rate(vx_video* me, float* out_fps)
 {
-	AVRational rate = me->fmt_ctx->streams[me->video_stream]->avg_frame_rate;
+	if(!me->video_codec_ctx)
+		return VX_ERR_VIDEO_STREAM;
+
+	AVStream* st = me->fmt_ctx->streams[me->video_stream];
+	AVRational rate = st->avg_frame_rate;
+
+	// without the stream analysis (VX_OF_FAST_OPEN) only the demuxer's guess from the header may be known
+	if(rate.num == 0 || rate.den == 0)
+		rate = st->r_frame_rate;
 
 	if(rate.num == 0 || rate.den == 0)
 		return VX_ERR_FRAME_RATE;  
@@ -697,15 +3693,30 @@ vx_error vx_get_frame_rate(vx_video* me, float* out_fps)
 
 vx_error vx_get_duration(vx_video* me, float* out_duration)
 {
+	// fall back to the span of the indexed timestamps when the container doesn't know
+	if(me->fmt_ctx->duration == AV_NOPTS_VALUE && me->index){
+		int64_t first = INT64_MAX, last = INT64_MIN;
+
+		for(int i = 0; i < me->num_index; i++){
+			if(me->index[i].pts == AV_NOPTS_VALUE)
+				continue;
+
+			first = FFMIN(first, me->index[i].pts);
+			last = FFMAX(last, me->index[i].pts);
+		}
+
+		if(first <= last){
+			*out_duration = (float)vx_timestamp_to_seconds(me, last - first);
+			return VX_ERR_SUCCESS;
+		}
+	}
+
 	*out_duration = (float)me->fmt_ctx->duration / (float)AV_TIME_BASE;
 	return VX_ERR_SUCCESS;
 }
 
 const char* vx_get_error_str(vx_error error)
 {
-	if(error > VX_ERR_SCALING)
-		error = VX_ERR_UNKNOWN;
-
 	const char* err_str[] = {
 		"video frame deferred",                  //VX_ERR_FRAME_DEFERRED  = -1,
 		"operation successful",                  //VX_ERR_SUCCESS         = 0,
@@ -723,19 +3734,30 @@ const char* vx_get_error_str(vx_error error)
 		"could not get pixel aspect ratio",      //VX_ERR_PIXEL_ASPECT    = 12,
 		"error while decoding audio",            //VX_ERR_DECODE_AUDIO    = 13,
 		"no audio available",                    //VX_ERR_NO_AUDIO        = 14,
-	  "error while resampling audio",          //VX_ERR_RESAMPLE_AUDIO  = 15,
+		"error while resampling audio",          //VX_ERR_RESAMPLE_AUDIO  = 15,
+		"could not seek",                        //VX_ERR_SEEK            = 16,
+		"invalid or outdated index",             //VX_ERR_INDEX           = 17,
+		"recovery budget exhausted",             //VX_ERR_RECOVERY_BUDGET = 18,
+		"operation timed out",                   //VX_ERR_TIMEOUT         = 19,
+		"operation cancelled",                   //VX_ERR_CANCELLED       = 20,
 	};
 
+	if(error < VX_ERR_FRAME_DEFERRED || error + 1 >= sizeof(err_str) / sizeof(err_str[0]))
+		error = VX_ERR_UNKNOWN;
+
 	return err_str[error + 1];
 }
 
 double vx_timestamp_to_seconds(vx_video* me, long long ts)
 {
-	return (double)ts * av_q2d(me->fmt_ctx->streams[me->video_stream]->time_base);
+	return (double)ts * av_q2d(me->fmt_ctx->streams[vx_main_stream(me)]->time_base);
 }
 
 vx_error vx_get_pixel_aspect_ratio(vx_video* me, float* out_par)
 {
+	if(!me->video_codec_ctx)
+		return VX_ERR_VIDEO_STREAM;
+
 	AVRational par = me->video_codec_ctx->sample_aspect_ratio;
 	if(par.num == 0 && par.den == 1)
 		return VX_ERR_PIXEL_ASPECT;
@@ -755,18 +3777,25 @@ vx_frame* vx_frame_create(int width, int height, vx_pix_fmt pix_fmt)
 	me->height = height;
 	me->pix_fmt = pix_fmt;
 
+	if(pix_fmt < VX_PIX_FMT_RGB24 || pix_fmt > VX_PIX_FMT_GBRP)
+		goto error;
+
 	int av_pixfmt = vx_to_av_pix_fmt(pix_fmt);
-	int size = avpicture_get_size(av_pixfmt, width, height);
+	int size = av_image_get_buffer_size(av_pixfmt, width, height, 1);
 
 	if(size <= 0)
 		goto error;
 
 	me->buffer = av_malloc(size);
-	memset(me->buffer, 0, size);
 
 	if(!me->buffer)
 		goto error;
 
+	memset(me->buffer, 0, size);
+
+	// tightly packed planes, one after the other
+	av_image_fill_arrays(me->planes, me->strides, me->buffer, av_pixfmt, width, height, 1);
+
 	return me;
 
 error:
@@ -776,12 +3805,100 @@ error:
 	return NULL;
 }
 
+vx_frame_batch* vx_frame_batch_create(int max_frames, int width, int height, vx_pix_fmt pix_fmt)
+{
+	if(max_frames <= 0 || pix_fmt < VX_PIX_FMT_RGB24 || pix_fmt > VX_PIX_FMT_GBRP)
+		return NULL;
+
+	vx_frame_batch* me = calloc(1, sizeof(vx_frame_batch));
+
+	if(!me)
+		goto error;
+
+	int av_pixfmt = vx_to_av_pix_fmt(pix_fmt);
+	int size = av_image_get_buffer_size(av_pixfmt, width, height, 1);
+
+	if(size <= 0)
+		goto error;
+
+	me->max_frames = max_frames;
+	me->buffer = av_mallocz((size_t)size * max_frames);
+	me->frames = calloc(max_frames, sizeof(vx_frame));
+	me->frame_ptrs = calloc(max_frames, sizeof(vx_frame*));
+
+	if(!me->buffer || !me->frames || !me->frame_ptrs)
+		goto error;
+
+	// each frame owns a slice of the shared buffer
+	for(int i = 0; i < max_frames; i++){
+		vx_frame* frame = &me->frames[i];
+
+		frame->width = width;
+		frame->height = height;
+		frame->pix_fmt = pix_fmt;
+
+		frame->buffer = (uint8_t*)me->buffer + (size_t)size * i;
+
+		av_image_fill_arrays(frame->planes, frame->strides, frame->buffer, av_pixfmt, width, height, 1);
+		me->frame_ptrs[i] = frame;
+	}
+
+	return me;
+
+error:
+	if(me)
+		vx_frame_batch_destroy(me);
+
+	return NULL;
+}
+
+void vx_frame_batch_destroy(vx_frame_batch* me)
+{
+	av_free(me->buffer);
+	free(me->frames);
+	free(me->frame_ptrs);
+	free(me);
+}
+
+vx_frame** vx_frame_batch_get_frames(vx_frame_batch* me)
+{
+	return me->frame_ptrs;
+}
+
+void* vx_frame_batch_get_buffer(vx_frame_batch* me)
+{
+	return me->buffer;
+}
+
 void vx_frame_destroy(vx_frame* me)
 {
+	if(me->ref)
+		av_frame_free(&me->ref);
+
 	av_free(me->buffer);
 	free(me);
 }
 
+int vx_frame_get_width(vx_frame* me)
+{
+	return me->width;
+}
+
+int vx_frame_get_height(vx_frame* me)
+{
+	return me->height;
+}
+
+vx_pix_fmt vx_frame_get_pix_fmt(vx_frame* me)
+{
+	return me->pix_fmt;
+}
+
+const char* vx_frame_get_pix_fmt_str(vx_frame* me)
+{
+	return av_get_pix_fmt_name(vx_frame_av_pix_fmt(me));
+}
+
 unsigned int vx_frame_get_flags(vx_frame* me)
 {
 	return me->info.flags;
@@ -807,25 +3924,269 @@ void* vx_frame_get_buffer(vx_frame* frame)
 	return frame->buffer;
 }
 
-vx_error vx_set_max_samples_per_frame(vx_video* me, int max_samples)
+int vx_frame_get_num_planes(vx_frame* me)
 {
-	me->max_samples = max_samples;
+	return av_pix_fmt_count_planes(vx_frame_av_pix_fmt(me));
+}
+
+void* vx_frame_get_plane(vx_frame* me, int plane)
+{
+	if(plane < 0 || plane >= vx_frame_get_num_planes(me))
+		return NULL;
+
+	return me->planes[plane];
+}
+
+int vx_frame_get_stride(vx_frame* me, int plane)
+{
+	if(plane < 0 || plane >= vx_frame_get_num_planes(me))
+		return 0;
+
+	return me->strides[plane];
+}
+
+vx_error vx_set_scale_params(vx_video* me, vx_scale_algorithm algorithm, int threads)
+{
+	assert(me);
+
+	if(algorithm < VX_SCALE_FAST_BILINEAR || algorithm > VX_SCALE_BICUBIC || threads < 0)
+		return VX_ERR_SCALING;
+
+	vx_async_halt(me);
+
+	// the cached scaler is rebuilt on the next frame since the settings no longer match
+	me->scale_algorithm = algorithm;
+	me->scale_threads = (me->options.flags & VX_OF_SINGLE_THREAD) ? 1 : threads;
+
 	return VX_ERR_SUCCESS;
 }
 
-vx_error vx_set_audio_params(vx_video* me, int sample_rate, int channels, vx_sample_fmt format, vx_audio_callback cb, void* user_data)
+vx_error vx_set_keyframes_only(vx_video* me, int enabled)
 {
-	vx_error err = VX_ERR_UNKNOWN;
+	assert(me);
 
-	if(me->audio_stream < 0)
+	if(!me->video_codec_ctx)
+		return VX_ERR_VIDEO_STREAM;
+
+	vx_async_halt(me);
+
+	// the non-key packets that follow reference frames the decoder never saw, start over at a keyframe
+	if(me->keyframes_only && !enabled){
+		avcodec_flush_buffers(me->video_codec_ctx);
+
+		if(me->pending_stream == me->video_stream)
+			me->pending_stream = -1;
+
+		me->seek_to_keyframe = true;
+	}
+
+	me->keyframes_only = enabled != 0;
+	me->video_codec_ctx->skip_frame = enabled ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+
+	return VX_ERR_SUCCESS;
+}
+
+static vx_error vx_set_sample_mode(vx_video* me, vx_sample_mode mode)
+{
+	if(!me->video_codec_ctx)
+		return VX_ERR_VIDEO_STREAM;
+
+	me->sample_mode = mode;
+	me->sample_restart = true;
+	me->sample_seekable = true;
+
+	if(!me->keyframes_only)
+		me->video_codec_ctx->skip_frame = AVDISCARD_DEFAULT;
+
+	return VX_ERR_SUCCESS;
+}
+
+vx_error vx_set_sample_fps(vx_video* me, double fps)
+{
+	assert(me);
+
+	vx_async_halt(me);
+
+	if(fps <= 0 || !me->video_codec_ctx)
+		return vx_set_sample_mode(me, VX_SAMPLE_NONE);
+
+	AVRational time_base = me->fmt_ctx->streams[me->video_stream]->time_base;
+	me->sample_interval = 1.0 / (fps * av_q2d(time_base));
+
+	return vx_set_sample_mode(me, VX_SAMPLE_FPS);
+}
+
+vx_error vx_set_sample_stride(vx_video* me, int stride)
+{
+	assert(me);
+
+	vx_async_halt(me);
+
+	me->sample_stride = stride;
+
+	return vx_set_sample_mode(me, stride > 1 ? VX_SAMPLE_STRIDE : VX_SAMPLE_NONE);
+}
+
+static int vx_compare_timestamps(const void* a, const void* b)
+{
+	int64_t ta = *(const int64_t*)a;
+	int64_t tb = *(const int64_t*)b;
+
+	return ta < tb ? -1 : ta > tb;
+}
+
+vx_error vx_set_sample_timestamps(vx_video* me, const long long* timestamps, int num_timestamps)
+{
+	assert(me);
+
+	vx_async_halt(me);
+
+	free(me->sample_timestamps);
+	me->sample_timestamps = NULL;
+	me->num_sample_timestamps = 0;
+
+	if(!timestamps || num_timestamps <= 0)
+		return vx_set_sample_mode(me, VX_SAMPLE_NONE);
+
+	me->sample_timestamps = malloc(num_timestamps * sizeof(int64_t));
+
+	if(!me->sample_timestamps){
+		vx_set_sample_mode(me, VX_SAMPLE_NONE);
+		return VX_ERR_ALLOCATE;
+	}
+
+	for(int i = 0; i < num_timestamps; i++)
+		me->sample_timestamps[i] = timestamps[i];
+
+	qsort(me->sample_timestamps, num_timestamps, sizeof(int64_t), vx_compare_timestamps);
+	me->num_sample_timestamps = num_timestamps;
+
+	return vx_set_sample_mode(me, VX_SAMPLE_TIMESTAMPS);
+}
+
+vx_error vx_get_stats(vx_video* me, vx_stats* out_stats)
+{
+	assert(me);
+
+	*out_stats = me->stats;
+
+	pthread_mutex_lock(&me->async.lock);
+	vx_stats_add(out_stats, &me->async.stats);
+	pthread_mutex_unlock(&me->async.lock);
+
+	// the file protocol keeps its own counters
+	if(!me->avio && me->fmt_ctx && me->fmt_ctx->pb){
+		out_stats->io_bytes_read = me->fmt_ctx->pb->bytes_read - me->io_bytes_base;
+		out_stats->io_seeks = me->fmt_ctx->pb->seek_count - me->io_seeks_base;
+	}
+
+	return VX_ERR_SUCCESS;
+}
+
+vx_error vx_reset_stats(vx_video* me)
+{
+	assert(me);
+
+	memset(&me->stats, 0, sizeof(vx_stats));
+
+	pthread_mutex_lock(&me->async.lock);
+	memset(&me->async.stats, 0, sizeof(vx_stats));
+	pthread_mutex_unlock(&me->async.lock);
+
+	if(!me->avio && me->fmt_ctx && me->fmt_ctx->pb){
+		me->io_bytes_base = me->fmt_ctx->pb->bytes_read;
+		me->io_seeks_base = me->fmt_ctx->pb->seek_count;
+	}
+
+	return VX_ERR_SUCCESS;
+}
+
+static vx_error vx_read_audio_timed(vx_video* me, void* buffer, int max_samples, int* out_num_samples, double* out_ts)
+{
+	if(!me->swr_ctx)
 		return VX_ERR_NO_AUDIO;
 
-	me->audio_cb = cb;
-	me->out_channels = channels;
-	me->out_sample_rate = sample_rate;
-	me->out_sample_format = format;
-	me->audio_user_data = user_data;
+	if(max_samples <= 0)
+		return VX_ERR_SUCCESS;
+
+	bool pull = !me->audio_cb;
+
+	// room for the chunk plus what one more audio frame can add
+	if(pull && !vx_audio_ring_reserve(me, max_samples * 2))
+		return VX_ERR_ALLOCATE;
+
+	int64_t until = pull ? max_samples : me->audio_samples_delivered + max_samples;
+	int64_t delivered_start = me->audio_samples_delivered;
+	bool video_waiting = false;
+
+	vx_error ret = vx_start_async_if_enabled(me);
+
+	for(int i = 0; ret == VX_ERR_SUCCESS && i < retry_count && vx_audio_progress(me) < until; i++){
+		ret = vx_fill_queue(me, until);
+
+		// transient decoding errors (same as vx_get_frame), deferring is for vx_get_frame only
+		if(ret == VX_ERR_UNKNOWN || ret == VX_ERR_DECODE_AUDIO || ret == VX_ERR_RESAMPLE_AUDIO || ret == VX_ERR_FRAME_DEFERRED)
+			ret = VX_ERR_SUCCESS;
+
+		// the queue is full of video frames waiting for vx_get_frame, return what there is
+		video_waiting = me->num_queue >= FRAME_QUEUE_SIZE;
+
+		if(video_waiting || me->decoding_error != VX_ERR_SUCCESS)
+			break;
+	}
+
+	// out_ts only means something for samples read from the ring, the callback gets its own
+	if(pull){
+		if(out_ts)
+			*out_ts = me->audio_ring_ts;
+
+		*out_num_samples = vx_audio_ring_read(me, buffer, max_samples);
+	}
+	else{
+		*out_num_samples = (int)(me->audio_samples_delivered - delivered_start);
+	}
+
+	if(*out_num_samples > 0)
+		return VX_ERR_SUCCESS;
+
+	if(ret != VX_ERR_SUCCESS)
+		return ret;
+
+	// nothing more is decoded until vx_get_frame takes the waiting video frames
+	if(video_waiting && me->decoding_error == VX_ERR_SUCCESS)
+		return VX_ERR_FRAME_DEFERRED;
+
+	return me->decoding_error;
+}
+
+vx_error vx_read_audio(vx_video* me, void* buffer, int max_samples, int* out_num_samples, double* out_ts)
+{
+	assert(me);
+
+	*out_num_samples = 0;
+
+	vx_error ret = vx_begin_call(me, false);
+
+	if(ret == VX_ERR_SUCCESS)
+		ret = vx_read_audio_timed(me, buffer, max_samples, out_num_samples, out_ts);
+
+	return vx_end_call(me, ret);
+}
+
+vx_error vx_set_max_samples_per_frame(vx_video* me, int max_samples)
+{
+	assert(me);
+
+	vx_async_halt(me);
+
+	me->max_samples = max_samples;
+	return VX_ERR_SUCCESS;
+}
 
+// (Re)creates the resampler from the audio decoder's current format to the output format. Only
+// touches swr_ctx and audio_buffer, the stream selection and the decoder are left alone.
+static vx_error vx_audio_init_resampler(vx_video* me)
+{
 	if(me->swr_ctx)
 		swr_free(&me->swr_ctx);
 	
@@ -836,12 +4197,12 @@ vx_error vx_set_audio_params(vx_video* me, int sample_rate, int channels, vx_sam
 			
 	AVCodecContext* ctx = me->audio_codec_ctx;
 
-	enum AVSampleFormat avfmt = format == VX_SAMPLE_FMT_FLT ? AV_SAMPLE_FMT_FLT : AV_SAMPLE_FMT_S16;
+	enum AVSampleFormat avfmt = vx_to_av_sample_fmt(me->out_sample_format);
 
 	int64_t src_channel_layout = ctx->channel_layout != 0 ? ctx->channel_layout :
 		av_get_default_channel_layout(ctx->channels);
 
-	me->swr_ctx = swr_alloc_set_opts(NULL, av_get_default_channel_layout(channels),
+	me->swr_ctx = swr_alloc_set_opts(NULL, av_get_default_channel_layout(me->out_channels),
 			avfmt, me->out_sample_rate, src_channel_layout, ctx->sample_fmt, ctx->sample_rate, 0, NULL);
 
 	me->swr_channels = ctx->channels;
@@ -849,19 +4210,92 @@ vx_error vx_set_audio_params(vx_video* me, int sample_rate, int channels, vx_sam
 	me->swr_sample_rate = ctx->sample_rate;
 	me->swr_sample_format = ctx->sample_fmt;
 	
-	if(!me->swr_ctx){
-		err = VX_ERR_ALLOCATE;
+	if(!me->swr_ctx)
 		goto cleanup;
-	}
 
 	swr_init(me->swr_ctx);
 
-	int ret = av_samples_alloc_array_and_samples(&me->audio_buffer, &me->audio_line_size, channels, sample_rate * 4, avfmt, 0);
+	int ret = av_samples_alloc_array_and_samples(&me->audio_buffer, &me->audio_line_size, me->out_channels,
+		me->out_sample_rate * 4, avfmt, 0);
+
+	if(ret < 0)
+		goto cleanup;
+
+	return VX_ERR_SUCCESS;
+
+cleanup:
+
+	if(me->swr_ctx)
+		swr_free(&me->swr_ctx);
+
+	if(me->audio_buffer){
+		av_freep(&me->audio_buffer[0]);
+		av_freep(&me->audio_buffer);
+	}
+
+	return VX_ERR_ALLOCATE;
+}
+
+vx_error vx_set_audio_params(vx_video* me, int sample_rate, int channels, vx_sample_fmt format, vx_audio_callback cb, void* user_data)
+{
+	vx_error err = VX_ERR_UNKNOWN;
+
+	if(me->audio_stream < 0)
+		return VX_ERR_NO_AUDIO;
+
+	// the pipeline threads read the stream selection and use the decoders
+	vx_async_halt(me);
+
+	// audio off, packets are skipped in the demuxer again
+	if(sample_rate <= 0 || channels <= 0){
+		me->audio_cb = NULL;
+		me->audio_user_data = NULL;
+		me->audio_ring_count = 0;
+		err = VX_ERR_SUCCESS;
+		goto cleanup;
+	}
+
+	if(!me->audio_codec_ctx){
+		AVCodec* codec = avcodec_find_decoder(vx_audio_codecpar(me)->codec_id);
+		int stream = me->audio_stream;
+
+		if(!codec)
+			return VX_ERR_FIND_CODEC;
 
-	if(ret < 0){
+		if(!open_codec(me, AVMEDIA_TYPE_AUDIO, codec, &stream, &me->audio_codec_ctx, &err))
+			return err;
+	}
+
+	me->audio_cb = cb;
+	me->out_channels = channels;
+	me->out_sample_rate = sample_rate;
+	me->out_sample_format = format;
+	me->audio_user_data = user_data;
+
+	err = vx_audio_init_resampler(me);
+
+	if(err != VX_ERR_SUCCESS)
+		goto cleanup;
+
+	// buffered samples in another format are of no use
+	int sample_size = channels * av_get_bytes_per_sample(vx_to_av_sample_fmt(format));
+
+	if(!cb && sample_size != me->audio_ring_sample_size){
+		av_freep(&me->audio_ring);
+		me->audio_ring_capacity = 0;
+		me->audio_ring_head = 0;
+		me->audio_ring_count = 0;
+		me->audio_ring_sample_size = sample_size;
+	}
+
+	if(!cb && !vx_audio_ring_reserve(me, sample_rate * 4)){
 		err = VX_ERR_ALLOCATE;
 		goto cleanup;
 	}
+
+	// start reading audio packets
+	me->audio_enabled = true;
+	vx_update_stream_discard(me);
 	
 	return VX_ERR_SUCCESS;
 
@@ -874,6 +4308,9 @@ cleanup:
 		av_freep(&me->audio_buffer[0]);
 		av_freep(&me->audio_buffer);
 	}
+
+	me->audio_enabled = false;
+	vx_update_stream_discard(me);
 	
 	return err;
 }
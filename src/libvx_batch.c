@@ -0,0 +1,404 @@
+// sysconf under -std=c99
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "libvx.h"
+
+// Uses nothing but the public api, every job is an ordinary vx_open/vx_get_frame/vx_close loop
+
+// the owner pushes and pops at the back, thieves take from the front
+typedef struct {
+	pthread_mutex_t lock;
+	int* tasks;
+	int head, num, capacity;
+} vx_batch_deque;
+
+typedef struct {
+	vx_batch_job job;
+	vx_batch_result* result;
+} vx_batch_task;
+
+typedef struct {
+	vx_batch* batch;
+	int index;
+	pthread_t thread;
+	vx_batch_deque deque;
+
+	// reused between jobs while the size matches
+	vx_frame* frame;
+} vx_batch_worker;
+
+struct vx_batch
+{
+	vx_batch_options options;
+	int num_cores;
+
+	vx_batch_worker* workers;
+	int num_workers;
+	int num_started;
+
+	// guards everything below, cond is broadcast on every change
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	vx_batch_task* tasks;
+	int num_tasks, task_capacity;
+
+	// submitted but not picked up yet, and being decoded
+	int num_queued;
+	int num_running;
+
+	int next_worker;
+	bool quit;
+};
+
+static int vx_batch_num_cores(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	int n = info.dwNumberOfProcessors;
+#else
+	int n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	return n > 0 ? n : 1;
+}
+
+static bool vx_batch_deque_push(vx_batch_deque* me, int task)
+{
+	if(me->num == me->capacity){
+		int capacity = me->capacity ? me->capacity * 2 : 64;
+		int* tasks = malloc(capacity * sizeof(int));
+
+		if(!tasks)
+			return false;
+
+		// unroll the ring into the new array
+		for(int i = 0; i < me->num; i++)
+			tasks[i] = me->tasks[(me->head + i) % me->capacity];
+
+		free(me->tasks);
+		me->tasks = tasks;
+		me->head = 0;
+		me->capacity = capacity;
+	}
+
+	me->tasks[(me->head + me->num) % me->capacity] = task;
+	me->num++;
+
+	return true;
+}
+
+static bool vx_batch_deque_take(vx_batch_deque* me, bool front, int* out_task)
+{
+	pthread_mutex_lock(&me->lock);
+
+	bool found = me->num > 0;
+
+	if(found){
+		if(front){
+			*out_task = me->tasks[me->head];
+			me->head = (me->head + 1) % me->capacity;
+		}
+		else{
+			*out_task = me->tasks[(me->head + me->num - 1) % me->capacity];
+		}
+
+		me->num--;
+	}
+
+	pthread_mutex_unlock(&me->lock);
+
+	return found;
+}
+
+// own queue first, then steal from the others starting with the next worker
+static bool vx_batch_next_task(vx_batch_worker* me, int* out_task)
+{
+	vx_batch* batch = me->batch;
+
+	if(vx_batch_deque_take(&me->deque, false, out_task))
+		return true;
+
+	for(int i = 1; i < batch->num_workers; i++){
+		vx_batch_worker* victim = &batch->workers[(me->index + i) % batch->num_workers];
+
+		if(vx_batch_deque_take(&victim->deque, true, out_task))
+			return true;
+	}
+
+	return false;
+}
+
+// with plenty of files every file gets one thread, the last few files of a batch share the idle cores
+static int vx_batch_decoder_threads(vx_batch* me, int num_active)
+{
+	if(me->options.decoder_threads > 0)
+		return me->options.decoder_threads;
+
+	int threads = me->num_cores / (num_active > 0 ? num_active : 1);
+
+	return threads > 1 ? threads : 1;
+}
+
+static void vx_batch_run_task(vx_batch_worker* me, const vx_batch_task* task, int threads)
+{
+	vx_batch* batch = me->batch;
+	const vx_batch_job* job = &task->job;
+	vx_batch_result* result = task->result;
+
+	vx_open_options options = batch->options.open_options;
+	options.thread_count = threads;
+
+	vx_video* video = NULL;
+
+	result->num_frames = 0;
+	result->error = job->filename ? vx_open_ex(&video, job->filename, &options) :
+		vx_open_io(&video, job->read_cb, job->seek_cb, job->size_cb, job->io_user_data, &options);
+
+	if(result->error != VX_ERR_SUCCESS)
+		return;
+
+	int width = batch->options.width > 0 ? batch->options.width : vx_get_width(video);
+	int height = batch->options.height > 0 ? batch->options.height : vx_get_height(video);
+
+	if(!me->frame || vx_frame_get_width(me->frame) != width || vx_frame_get_height(me->frame) != height){
+		if(me->frame)
+			vx_frame_destroy(me->frame);
+
+		me->frame = vx_frame_create(width, height, batch->options.pix_fmt);
+
+		if(!me->frame){
+			result->error = VX_ERR_ALLOCATE;
+			goto cleanup;
+		}
+	}
+
+	vx_error ret;
+
+	while((ret = vx_get_frame(video, me->frame)) <= VX_ERR_SUCCESS){
+		if(ret == VX_ERR_FRAME_DEFERRED)
+			continue;
+
+		result->num_frames++;
+
+		if(job->frame_cb && !job->frame_cb(me->frame, job->user_data))
+			break;
+	}
+
+	result->error = ret == VX_ERR_EOF ? VX_ERR_SUCCESS : ret;
+
+cleanup:
+	vx_close(video);
+}
+
+static void* vx_batch_worker_main(void* data)
+{
+	vx_batch_worker* me = data;
+	vx_batch* batch = me->batch;
+
+	while(true){
+		int task_idx;
+
+		if(!vx_batch_next_task(me, &task_idx)){
+			pthread_mutex_lock(&batch->lock);
+
+			while(!batch->quit && batch->num_queued == 0)
+				pthread_cond_wait(&batch->cond, &batch->lock);
+
+			bool quit = batch->quit && batch->num_queued == 0;
+			pthread_mutex_unlock(&batch->lock);
+
+			if(quit)
+				break;
+
+			continue;
+		}
+
+		// the task array may be reallocated by vx_batch_submit, take a copy
+		pthread_mutex_lock(&batch->lock);
+		vx_batch_task task = batch->tasks[task_idx];
+		batch->num_queued--;
+		batch->num_running++;
+		int threads = vx_batch_decoder_threads(batch, batch->num_queued + batch->num_running);
+		pthread_mutex_unlock(&batch->lock);
+
+		vx_batch_run_task(me, &task, threads);
+
+		pthread_mutex_lock(&batch->lock);
+		batch->num_running--;
+		pthread_cond_broadcast(&batch->cond);
+		pthread_mutex_unlock(&batch->lock);
+	}
+
+	return NULL;
+}
+
+void vx_batch_options_init(vx_batch_options* options)
+{
+	assert(options);
+
+	memset(options, 0, sizeof(vx_batch_options));
+	options->pix_fmt = VX_PIX_FMT_RGB24;
+	vx_open_options_init(&options->open_options);
+}
+
+vx_error vx_batch_create(vx_batch** batch, const vx_batch_options* options)
+{
+	vx_batch* me = calloc(1, sizeof(vx_batch));
+
+	if(!me)
+		return VX_ERR_ALLOCATE;
+
+	if(options)
+		me->options = *options;
+	else
+		vx_batch_options_init(&me->options);
+
+	pthread_mutex_init(&me->lock, NULL);
+	pthread_cond_init(&me->cond, NULL);
+
+	me->num_cores = vx_batch_num_cores();
+	me->num_workers = me->options.num_workers > 0 ? me->options.num_workers : me->num_cores;
+	me->workers = calloc(me->num_workers, sizeof(vx_batch_worker));
+
+	if(!me->workers)
+		goto error;
+
+	for(int i = 0; i < me->num_workers; i++){
+		me->workers[i].batch = me;
+		me->workers[i].index = i;
+		pthread_mutex_init(&me->workers[i].deque.lock, NULL);
+	}
+
+	for(; me->num_started < me->num_workers; me->num_started++){
+		if(pthread_create(&me->workers[me->num_started].thread, NULL, vx_batch_worker_main, &me->workers[me->num_started]) != 0)
+			goto error;
+	}
+
+	*batch = me;
+	return VX_ERR_SUCCESS;
+
+error:
+	vx_batch_destroy(me);
+	return VX_ERR_ALLOCATE;
+}
+
+vx_error vx_batch_submit(vx_batch* me, const vx_batch_job* jobs, vx_batch_result* results, int num_jobs)
+{
+	assert(me);
+
+	vx_error ret = VX_ERR_SUCCESS;
+
+	pthread_mutex_lock(&me->lock);
+
+	// start over once everything submitted so far is done
+	if(me->num_queued == 0 && me->num_running == 0)
+		me->num_tasks = 0;
+
+	int first = me->num_tasks;
+
+	if(me->num_tasks + num_jobs > me->task_capacity){
+		int capacity = me->task_capacity ? me->task_capacity : 64;
+
+		while(capacity < me->num_tasks + num_jobs)
+			capacity *= 2;
+
+		vx_batch_task* tasks = realloc(me->tasks, capacity * sizeof(vx_batch_task));
+
+		if(!tasks){
+			ret = VX_ERR_ALLOCATE;
+			goto cleanup;
+		}
+
+		me->tasks = tasks;
+		me->task_capacity = capacity;
+	}
+
+	// round robin over the workers, stealing evens out whatever the file sizes turn out to be
+	for(int i = 0; i < num_jobs; i++){
+		vx_batch_task* task = &me->tasks[me->num_tasks];
+		vx_batch_deque* deque = &me->workers[me->next_worker].deque;
+
+		task->job = jobs[i];
+		task->result = &results[i];
+		task->result->error = VX_ERR_UNKNOWN;
+		task->result->num_frames = 0;
+
+		pthread_mutex_lock(&deque->lock);
+		bool pushed = vx_batch_deque_push(deque, me->num_tasks);
+		pthread_mutex_unlock(&deque->lock);
+
+		if(!pushed){
+			ret = VX_ERR_ALLOCATE;
+			goto cleanup;
+		}
+
+		me->num_tasks++;
+		me->num_queued++;
+		me->next_worker = (me->next_worker + 1) % me->num_workers;
+	}
+
+cleanup:
+	// jobs that could not be queued
+	for(int i = me->num_tasks - first; i < num_jobs; i++)
+		results[i].error = ret;
+
+	pthread_cond_broadcast(&me->cond);
+	pthread_mutex_unlock(&me->lock);
+
+	return ret;
+}
+
+void vx_batch_wait(vx_batch* me)
+{
+	assert(me);
+
+	pthread_mutex_lock(&me->lock);
+
+	while(me->num_queued > 0 || me->num_running > 0)
+		pthread_cond_wait(&me->cond, &me->lock);
+
+	pthread_mutex_unlock(&me->lock);
+}
+
+void vx_batch_destroy(vx_batch* me)
+{
+	assert(me);
+
+	pthread_mutex_lock(&me->lock);
+	me->quit = true;
+	pthread_cond_broadcast(&me->cond);
+	pthread_mutex_unlock(&me->lock);
+
+	// workers only quit once every queue is empty
+	for(int i = 0; i < me->num_started; i++)
+		pthread_join(me->workers[i].thread, NULL);
+
+	for(int i = 0; me->workers && i < me->num_workers; i++){
+		if(me->workers[i].frame)
+			vx_frame_destroy(me->workers[i].frame);
+
+		free(me->workers[i].deque.tasks);
+		pthread_mutex_destroy(&me->workers[i].deque.lock);
+	}
+
+	pthread_mutex_destroy(&me->lock);
+	pthread_cond_destroy(&me->cond);
+
+	free(me->workers);
+	free(me->tasks);
+	free(me);
+}
@@ -65,28 +65,68 @@ void count_frames_callback(int stream, void* data)
 	printf("frame in stream: %d\n", stream);
 }
 
+// toggles keyframe only mode mid-stream, after turning it off decoding has to pick up at a keyframe
+void test_keyframes_only_toggle(const char* filename)
+{
+	vx_video* video = NULL;
+	vx_error ret = vx_open(&video, filename, 0);
+	LASSERT(ret == VX_ERR_SUCCESS, "could not open video file: %s", filename);
+
+	vx_frame* frame = vx_frame_create(vx_get_width(video), vx_get_height(video), VX_PIX_FMT_RGB32);
+	LASSERT(frame, "could not allocate frame");
+
+	for(int i = 0; i < 5 && (ret = vx_get_frame(video, frame)) <= VX_ERR_SUCCESS; i++);
+
+	ret = vx_set_keyframes_only(video, 1);
+	LASSERT(ret == VX_ERR_SUCCESS, "could not enable keyframe only mode");
+
+	for(int i = 0; i < 2 && (ret = vx_get_frame(video, frame)) <= VX_ERR_SUCCESS; i++){
+		if(ret == VX_ERR_SUCCESS)
+			LASSERT(vx_frame_get_flags(frame) & VX_FF_KEYFRAME, "non-key frame in keyframe only mode");
+	}
+
+	ret = vx_set_keyframes_only(video, 0);
+	LASSERT(ret == VX_ERR_SUCCESS, "could not disable keyframe only mode");
+
+	while((ret = vx_get_frame(video, frame)) == VX_ERR_FRAME_DEFERRED);
+
+	if(ret == VX_ERR_SUCCESS)
+		LASSERT(vx_frame_get_flags(frame) & VX_FF_KEYFRAME, "decoding did not resume at a keyframe");
+
+	int num_frames = 0;
+
+	while((ret = vx_get_frame(video, frame)) <= VX_ERR_SUCCESS && num_frames < 30)
+		num_frames += ret == VX_ERR_SUCCESS;
+
+	LASSERT(ret == VX_ERR_SUCCESS || ret == VX_ERR_EOF, "decoding failed after keyframe only mode: %s", vx_get_error_str(ret));
+
+	printf("keyframe only toggle: ok\n");
+
+	vx_frame_destroy(frame);
+	vx_close(video);
+}
+
 int main(int argc, char** argv)
 {
 	LASSERT(argc == 2, "usage: %s [videofile]", argv[0]);
+
+	test_keyframes_only_toggle(argv[1]);
 	
 	int num_frames;
 	vx_error ret;
 	 
 	vx_video* video = NULL;
 
-	ret = vx_open(&video, argv[1], 0);
-	LASSERT(ret == VX_ERR_SUCCESS, "could not open file for frame counting: %s", argv[1]);	
+	ret = vx_open(&video, argv[1], VX_OF_HW_ACCEL_1440);
+	LASSERT(ret == VX_ERR_SUCCESS, "could not open video file: %s", argv[1]);	
 
 	vx_set_count_frames_cb(video, count_frames_callback, NULL);
 	
-	ret = vx_count_frames(video, &num_frames);
+	vx_count_method method;
+	ret = vx_count_frames_ex(video, &num_frames, &method);
 	LASSERT(ret == VX_ERR_SUCCESS, "error counting frames");	
-	vx_close(video);
 	
-	printf("num_frames: %d\n", num_frames);
-
-	ret = vx_open(&video, argv[1], VX_OF_HW_ACCEL_1440);
-	LASSERT(ret == VX_ERR_SUCCESS, "could not open video file: %s", argv[1]);	
+	printf("num_frames: %d (method: %d)\n", num_frames, method);
 	
 	int w = vx_get_width(video);
 	int h = vx_get_height(video);